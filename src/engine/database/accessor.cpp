@@ -1,12 +1,18 @@
 #include "accessor.h"
 #include <utils/platform.h>
 #include <net/scheduler.h>
-#include <list>
+#include <utils/node_pool.h>
+#include <utils/mpmc_queue.h>
+#include <utils/logger.h>
+#include <deque>
+#include <unordered_map>
 #include <vector>
 #include <mutex>
 #include <thread>
 #include <condition_variable>
 #include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
 
 #ifdef PLATFORM_WIN32
 #include <WinSock2.h>
@@ -16,37 +22,442 @@
 using namespace mysql;
 using namespace std::placeholders;
 
-typedef std::shared_ptr<Query> QueryPtr;
+// microsec, the same clock on every thread
+static int64 nowMicro()
+{
+	return (int64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// single writer: no locked instruction needed
+static void addRelaxed(std::atomic<uint64>& counter, uint64 value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// a query on its way through the workers. pooled, PostQuery() moves the query in
+// and the last reference gives the node back
+struct Flights;
+
+struct QueryNode
+{
+	Query             query;
+	std::atomic<int>  refs;
+	std::shared_ptr<Flights> flights;    // single flight: registered there until handled
+	std::vector<ResultHandler> waiters;  // identical selects posted meanwhile, guarded by flights
+	int64             postTime;          // nowMicro() at PostQuery()
+	QueryNode*        poolNext;
+
+	QueryNode() : refs(0), poolNext(nullptr) {}
+};
+
+// selects in flight by sql and layout, identical ones wait for the first one's result
+struct Flights
+{
+	std::mutex mutex;
+	std::unordered_map<std::string, QueryNode*> queries;
+
+	// one read-only statement, answered with one result
+	static bool sharable(const Query& query)
+	{
+		if ((query.queryType != QueryType::Query && query.queryType != QueryType::NormalQuery)
+			|| query.bindThread != 0 || query.allThreadQuery || !query.handler)
+			return false;
+
+		const std::string& sql = query.sql;
+		size_t i = 0;
+		while (i < sql.size() && isspace((unsigned char)sql[i]))
+			++i;
+		if (sql.size() - i < 7 || !isspace((unsigned char)sql[i + 6]))
+			return false;
+		for (size_t k = 0; k < 6; ++k)
+		{
+			if (toupper((unsigned char)sql[i + k]) != "SELECT"[k])
+				return false;
+		}
+		return sql.find(';') == std::string::npos;
+	}
+
+	static std::string key(const Query& query)
+	{
+		std::string key = query.sql;
+		key += '\0';
+		key += char('0' + (int)query.layout);
+		return key;
+	}
+};
+
+typedef utils::NodePool<QueryNode> QueryNodePool;
+
+// counted reference to a QueryNode, held by the dispatch queues, the worker running it
+// and its result events. one node is shared by every worker of an allThreadQuery
+class QueryPtr
+{
+public:
+	QueryPtr() : node_(nullptr) {}
+
+	// takes over a reference, see retain()
+	explicit QueryPtr(QueryNode* node) : node_(node) {}
+
+	QueryPtr(const QueryPtr& rh) : node_(rh.node_)
+	{
+		if (node_ != nullptr)
+			node_->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	QueryPtr(QueryPtr&& rh) : node_(rh.node_) { rh.node_ = nullptr; }
+
+	~QueryPtr() { reset(); }
+
+	QueryPtr& operator=(QueryPtr rh)
+	{
+		std::swap(node_, rh.node_);
+		return *this;
+	}
+
+	static QueryPtr make(Query&& query)
+	{
+		QueryNode* node = QueryNodePool::Alloc();
+		node->query = std::move(query);
+		node->refs.store(1, std::memory_order_relaxed);
+		node->postTime = nowMicro();
+		return QueryPtr(node);
+	}
+
+	void reset()
+	{
+		if (node_ != nullptr && node_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			// no result was handled (lost connection, Release()): later identical selects
+			// must not wait on a node about to be reused
+			if (node_->flights)
+			{
+				std::lock_guard<std::mutex> guard(node_->flights->mutex);
+				auto it = node_->flights->queries.find(Flights::key(node_->query));
+				if (it != node_->flights->queries.end() && it->second == node_)
+					node_->flights->queries.erase(it);
+			}
+
+			// drops the handler captures now, not when the node is reused
+			node_->query = Query();
+			node_->flights.reset();
+			node_->waiters.clear();
+			QueryNodePool::Free(node_);
+		}
+		node_ = nullptr;
+	}
+
+	// a new reference for a queue
+	QueryNode* retain() const
+	{
+		node_->refs.fetch_add(1, std::memory_order_relaxed);
+		return node_;
+	}
+
+	QueryNode* get() const { return node_; }
+	Query* operator->() const { return &node_->query; }
+	Query& operator*() const { return node_->query; }
+	explicit operator bool() const { return node_ != nullptr; }
+
+private:
+	QueryNode* node_;
+};
+
+enum
+{
+	DISPATCH_QUEUE_SIZE = 64 * 1024, // queries any worker may run
+	BOUND_QUEUE_SIZE    = 1024,      // per worker: bindThread and allThreadQuery
+	COALESCE_MAX_BYTES  = 512 * 1024, // sql of one coalesced round trip, below max_allowed_packet
+};
+
+// lock-free ring of queries, with a locked overflow list once the ring is full,
+// so posting never waits. one producer's queries keep their order for a single consumer
+class DispatchQueue
+{
+public:
+	explicit DispatchQueue(size_t capacity) : ring_(capacity), overflowSize_(0) {}
+
+	~DispatchQueue()
+	{
+		while (QueryNode* node = pop())
+			QueryPtr(node).reset();
+	}
+
+	// takes over a reference
+	void push(QueryNode* node)
+	{
+		// once anything overflowed, later queries queue behind it
+		if (overflowSize_.load(std::memory_order_acquire) == 0 && ring_.Push(node))
+			return;
+
+		std::lock_guard<std::mutex> guard(overflowMutex_);
+		overflow_.push_back(node);
+		overflowSize_.fetch_add(1, std::memory_order_release);
+	}
+
+	// nullptr when empty
+	QueryNode* pop()
+	{
+		QueryNode* node = nullptr;
+		if (ring_.Pop(node))
+			return node;
+		if (overflowSize_.load(std::memory_order_acquire) == 0)
+			return nullptr;
+
+		std::lock_guard<std::mutex> guard(overflowMutex_);
+		if (overflow_.empty())
+			return nullptr;
+		node = overflow_.front();
+		overflow_.pop_front();
+		overflowSize_.fetch_sub(1, std::memory_order_release);
+		return node;
+	}
+
+	bool empty() const { return ring_.Empty() && overflowSize_.load(std::memory_order_acquire) == 0; }
+
+	// approximate
+	size_t size() const { return ring_.Size() + overflowSize_.load(std::memory_order_relaxed); }
+
+private:
+	utils::MPMCQueue<QueryNode*> ring_;
+	std::atomic<size_t> overflowSize_;
+	std::deque<QueryNode*> overflow_;
+	std::mutex overflowMutex_;
+};
+
+// shared by the accessor and its workers. workers pull from queue_ themselves,
+// idle ones sleep on cond_ and posting only takes the mutex when someone sleeps
+struct Dispatcher
+{
+	DispatchQueue queue_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::atomic<int> idle_;
+
+	Dispatcher() : queue_(DISPATCH_QUEUE_SIZE), idle_(0) {}
+
+	void post(const QueryPtr& query)
+	{
+		queue_.push(query.retain());
+		wake(false);
+	}
+
+	// all: a query bound to one worker, which ever of them it is
+	void wake(bool all)
+	{
+		// pairs with the fence in wait(): either the sleeper sees the push or we see the sleeper
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (idle_.load(std::memory_order_relaxed) == 0)
+			return;
+
+		std::lock_guard<std::mutex> guard(mutex_);
+		if (all)
+			cond_.notify_all();
+		else
+			cond_.notify_one();
+	}
+
+	// until a post, stop or the timeout
+	void wait(const DispatchQueue& bound, const bool& working, const std::chrono::steady_clock::duration& timeout)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (working && bound.empty() && queue_.empty())
+			cond_.wait_for(lock, timeout);
+		idle_.fetch_sub(1, std::memory_order_relaxed);
+	}
+};
+
+// batch chunks posted to the serial and not handled yet, shared by a worker and its events
+struct StreamWindow
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int inflight;
+
+	StreamWindow() : inflight(0) {}
+
+	// waits for room, false when the worker is stopping
+	bool Acquire(int limit, const bool& working)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (limit > 0 && inflight >= limit)
+		{
+			if (!working) return false;
+			cond.wait_for(lock, std::chrono::milliseconds(100));
+		}
+		++inflight;
+		return true;
+	}
+
+	void Release()
+	{
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			--inflight;
+		}
+		cond.notify_one();
+	}
+};
+
+// a result on its way to the serial. pooled, so posting it doesn't allocate
+// and the row buffer keeps its capacity for the next result
+struct QueryStats;
+
+struct ResultEvent
+{
+	QueryPtr          query;
+	Result            result;
+	std::vector<char> buff;
+	std::vector<Column> columns;
+	std::shared_ptr<StreamWindow> window; // streamed chunk, released when handled
+	std::shared_ptr<QueryStats> stats;    // the first result of a timed query
+	int64             started;  // nowMicro() when the worker took the query
+	int64             answered; // when the server's answer was in
+	int64             posted;   // when posted to the serial, timed only
+	ResultEvent*      poolNext;
+
+	ResultEvent() : poolNext(nullptr) {}
+};
+
+typedef utils::NodePool<ResultEvent> ResultEventPool;
+
+// larger buffers are not kept in the pool
+enum { RESULT_EVENT_KEEP_BUFFER = 64 * 1024 };
+
+struct ResultEventRelease
+{
+	void operator()(ResultEvent* event) const
+	{
+		event->query.reset();
+		if (event->window)
+		{
+			event->window->Release();
+			event->window.reset();
+		}
+		event->stats.reset();
+		if (event->buff.capacity() > RESULT_EVENT_KEEP_BUFFER)
+			std::vector<char>().swap(event->buff);
+		else
+			event->buff.clear();
+		event->columns.clear();
+		ResultEventPool::Free(event);
+	}
+};
+
+typedef std::unique_ptr<ResultEvent, ResultEventRelease> ResultEventPtr;
+
+// a prepared statement of one worker connection, kept until an execute fails.
+// result columns are bound straight into the row layout of buildColumns
+struct Statement
+{
+	MYSQL_STMT*             stmt;
+	MYSQL_RES*              meta; // nullptr: no result set
+	std::vector<MYSQL_BIND> params;
+	std::vector<MYSQL_BIND> columns;
+	std::vector<MYSQL_TIME> paramTimes;  // time params are bound here, by param index
+	std::vector<MYSQL_TIME> columnTimes; // time columns are fetched here, by column index
+
+	Statement() : stmt(nullptr), meta(nullptr) {}
+
+	~Statement()
+	{
+		if (meta != nullptr)
+			mysql_free_result(meta);
+		if (stmt != nullptr)
+			mysql_stmt_close(stmt);
+	}
+};
+
+// MYSQL_TIME differs between client versions (8.0.19 added time_zone_displacement),
+// so the binary protocol goes through a real one and mysql::Time is copied field by field
+static void toMysqlTime(const Time& from, MYSQL_TIME& to)
+{
+	memset(&to, 0, sizeof(to));
+	to.year = from.year;
+	to.month = from.month;
+	to.day = from.day;
+	to.hour = from.hour;
+	to.minute = from.minute;
+	to.second = from.second;
+	to.second_part = from.second_part;
+	to.neg = from.reserve1 != 0;
+	to.time_type = MYSQL_TIMESTAMP_DATETIME;
+}
+
+static void fromMysqlTime(const MYSQL_TIME& from, Time& to)
+{
+	memset(&to, 0, sizeof(to));
+	to.year = from.year;
+	to.month = from.month;
+	to.day = from.day;
+	to.hour = from.hour;
+	to.minute = from.minute;
+	to.second = from.second;
+	to.second_part = from.second_part;
+	to.reserve1 = from.neg ? 1 : 0;
+}
 
 /////////////////////////////////////////////////////////////////////////////
 class Worker : public std::enable_shared_from_this<Worker>
 {
 public:
 	typedef std::shared_ptr<Worker> Ptr;
-	typedef std::function<void(Ptr)> QueryFinishedHandlerType;
 
-	Worker(Accessor* mgr, const QueryFinishedHandlerType& query_finished, Serial& serial);
+	Worker(Accessor* mgr, const std::shared_ptr<Dispatcher>& dispatcher, const std::shared_ptr<QueryStats>& stats, Serial& serial);
 	~Worker();
 
 	bool start(const ConnectParams& params);
 	void stop();
 
-	void post(const QueryPtr& query);
-
+	// runs on this worker only, in post order
 	void post_to_queue(const QueryPtr& query);
 
 	unsigned int get_query_queue_size();
 
+	WorkerStats get_stats();
+
 private:
 	void run();
 
-	void handle_query(const QueryPtr query);
+	// the clock of the query about to run
+	void begin_query();
+
+	void handle_query(const QueryPtr& query);
+
+	void handle_statement(const QueryPtr& query);
+
+	// collects more executes from the queue for one round trip
+	void handle_coalesced(const QueryPtr& first);
+
+	void execute_batch(std::vector<QueryPtr>& batch);
+	void post_error(const QueryPtr& query, int error);
+
+	// prepared on first use, nullptr on error
+	Statement* get_statement(const std::string& sql, int& error);
+
+	// one column of a text protocol row, returns its width
+	size_t getField(MYSQL_FIELD* field, const char* value, unsigned long length, char* buff);
+
+	// a text protocol row, packed strings and blobs are appended to buff
+	void putRow(const std::vector<Column>& columns, RowLayout layout, MYSQL_FIELD* fields, MYSQL_ROW row, unsigned long* lengths, std::vector<char>& buff, size_t rowIndex, size_t rowSize);
+
+	// columns of a result set and their place in a row, returns the row size
+	static size_t buildColumns(MYSQL_FIELD* fields, uint count, RowLayout layout, std::vector<Column>& columns);
+
+	// bytes before the packed area for `rows` rows.
+	// columnar: gives each column its array and null bitmap
+	static size_t placeColumns(RowLayout layout, std::vector<Column>& columns, size_t rows, size_t rowSize);
 
-	size_t getField(MYSQL_FIELD* field, MYSQL_ROW row, char* buff);
+	// bytes of one column in a fixed row, 0: not returned
+	static size_t columnWidth(MYSQL_FIELD* field);
 
-	size_t calcRowSize(MYSQL_RES* res);
+	ResultEventPtr new_result_event(const QueryPtr& query);
 
-	void handle_result(const QueryPtr query, Result result, std::shared_ptr<std::vector<char> > buff);
+	// result.data, if any, points into event->buff
+	void post_result(ResultEventPtr event, const Result& result);
+
+	static void handle_result(ResultEventPtr& event);
 
 private:
 	Accessor* parent_;
@@ -54,26 +465,55 @@ private:
 	MYSQL conn_;
 
 	std::shared_ptr<std::thread> thread_;
+	utils::CPUSet affinity_;
+
+	// by sql, worker thread only
+	std::unordered_map<std::string, std::unique_ptr<Statement>> statements_;
+
+	std::shared_ptr<StreamWindow> window_;
+
+	bool coalesce_;
+	uint coalesceWindow_;
+	uint coalesceMax_;
+	std::vector<QueryPtr> batch_;
 
 	bool working_;
 
-	typedef std::list<QueryPtr> QueryQueue;
-	QueryQueue query_queue_;
-	QueryPtr follower_query_;
+	std::shared_ptr<Dispatcher> dispatcher_;
+	DispatchQueue bound_;
 
-	std::condition_variable_any cond_;
-	std::mutex mutex_;
+	// timing, see QueryStats
+	std::shared_ptr<QueryStats> stats_;
+	int64 started_;
+	int64 answered_;
+	QueryNode* timed_; // got its first result event
+
+	// read by Accessor::GetWorkerStats()
+	std::atomic<uint64> queries_;
+	std::atomic<uint64> busyTime_;
+	std::atomic<int64> busySince_; // 0: idle
 
-	QueryFinishedHandlerType on_query_finished;
 	Serial& serial;
 };
 
 /////////////////////////////////////////////////////////////////////////////
 
-Worker::Worker(Accessor* parent, const QueryFinishedHandlerType& query_finished, Serial& serial)
+Worker::Worker(Accessor* parent, const std::shared_ptr<Dispatcher>& dispatcher, const std::shared_ptr<QueryStats>& stats, Serial& serial)
 	: parent_(parent)
+	, window_(new StreamWindow())
+	, coalesce_(false)
+	, coalesceWindow_(0)
+	, coalesceMax_(0)
 	, working_(false)
-	, on_query_finished(query_finished)
+	, dispatcher_(dispatcher)
+	, bound_(BOUND_QUEUE_SIZE)
+	, stats_(stats)
+	, started_(0)
+	, answered_(0)
+	, timed_(nullptr)
+	, queries_(0)
+	, busyTime_(0)
+	, busySince_(0)
 	, serial(serial)
 {
 }
@@ -100,7 +540,13 @@ bool Worker::start(const ConnectParams& params)
 		return false;
 	}
 
+	// coalesced executes are sent as one multi-statement round trip, see execute_batch()
+	coalesce_ = params.coalesce && params.coalesceMax > 1;
+	coalesceWindow_ = params.coalesceWindow;
+	coalesceMax_ = params.coalesceMax;
+
 	working_ = true;
+	affinity_ = params.affinity;
 
 	thread_.reset(new std::thread(&Worker::run, shared_from_this()));
 	return true;
@@ -112,498 +558,1255 @@ void Worker::stop()
 
 	if (thread_ != nullptr)
 	{
-		cond_.notify_one();
+		dispatcher_->wake(true);
 		thread_->join();
 		thread_.reset();
 	}
 
+	statements_.clear();
 	mysql_close(&conn_);
 }
 
-void Worker::post(const QueryPtr& query)
+void Worker::post_to_queue(const QueryPtr& query)
+{
+	if (!working_) return;
+
+	bound_.push(query.retain());
+	dispatcher_->wake(true);
+}
+
+unsigned int Worker::get_query_queue_size()
+{
+	return (unsigned int)bound_.size();
+}
+
+WorkerStats Worker::get_stats()
 {
+	WorkerStats stats;
+	int64 since = busySince_.load(std::memory_order_relaxed);
+	stats.queued = (uint)bound_.size();
+	stats.busy = since != 0;
+	stats.queries = queries_.load(std::memory_order_relaxed);
+	stats.busyTime = busyTime_.load(std::memory_order_relaxed);
+	if (since != 0)
 	{
-		std::lock_guard<std::mutex> guard(mutex_);
-		assert(follower_query_ == nullptr);
-		follower_query_ = query;
+		int64 now = nowMicro();
+		stats.busyTime += now > since ? uint64(now - since) : 0;
 	}
+	return stats;
+}
 
-	cond_.notify_one();
+// skips a quoted string or identifier at sql[i], npos if it doesn't end
+static size_t skipQuoted(const std::string& sql, size_t i)
+{
+	char quote = sql[i];
+	for (++i; i < sql.size(); ++i)
+	{
+		if (sql[i] == '\\' && quote != '`')
+		{
+			++i;
+			continue;
+		}
+		if (sql[i] == quote)
+		{
+			if (i + 1 < sql.size() && sql[i + 1] == quote)
+			{
+				++i;
+				continue;
+			}
+			return i + 1;
+		}
+	}
+	return std::string::npos;
 }
 
-void Worker::post_to_queue(const QueryPtr& query)
+static bool isWordChar(char c)
 {
-	if (!working_) return;
+	return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
 
+// case insensitive keyword at sql[i], as a whole word
+static bool matchWord(const std::string& sql, size_t i, const char* word)
+{
+	size_t length = strlen(word);
+	if (i + length > sql.size() || (i > 0 && isWordChar(sql[i - 1])))
+		return false;
+	for (size_t k = 0; k < length; ++k)
 	{
-		std::lock_guard<std::mutex> guard(mutex_);
-		query_queue_.push_back(query);
+		if (toupper((unsigned char)sql[i + k]) != word[k])
+			return false;
 	}
+	return i + length == sql.size() || !isWordChar(sql[i + length]);
+}
 
-	cond_.notify_one();
+static size_t skipSpace(const std::string& sql, size_t i)
+{
+	while (i < sql.size() && isspace((unsigned char)sql[i]))
+		++i;
+	return i;
 }
 
-unsigned int Worker::get_query_queue_size()
+// an Execute that can share a round trip: one statement, no comments, quotes closed
+static bool coalescable(const Query& query)
 {
-	std::lock_guard<std::mutex> guard(mutex_);
-	return query_queue_.size();
+	if (query.queryType != QueryType::Execute || query.bindThread != 0 || query.allThreadQuery)
+		return false;
+
+	const std::string& sql = query.sql;
+	for (size_t i = 0; i < sql.size();)
+	{
+		char c = sql[i];
+		if (c == '\'' || c == '"' || c == '`')
+		{
+			i = skipQuoted(sql, i);
+			if (i == std::string::npos)
+				return false;
+			continue;
+		}
+		if (c == ';' || c == '#' || (c == '-' && sql.compare(i, 2, "--") == 0) || (c == '/' && sql.compare(i, 2, "/*") == 0))
+			return false;
+		++i;
+	}
+	return true;
 }
 
-void Worker::run()
+// "INSERT INTO ... VALUES (...), (...)" with nothing after the rows.
+// head: the part up to VALUES, statements with the same head are merged into one.
+// REPLACE isn't merged: its affected rows count a replaced row twice
+static bool parseInsert(const std::string& sql, size_t& head, size_t& rows)
 {
-	QueryQueue query_queue;
-	QueryPtr follower_query;
+	size_t i = skipSpace(sql, 0);
+	if (!matchWord(sql, i, "INSERT"))
+		return false;
+	i += 6;
 
-	while (working_)
+	// modifiers such as IGNORE change what the row count means
+	i = skipSpace(sql, i);
+	if (!matchWord(sql, i, "INTO"))
+		return false;
+
+	int depth = 0;
+	for (head = 0; i < sql.size() && head == 0;)
+	{
+		char c = sql[i];
+		if (c == '\'' || c == '"' || c == '`')
+		{
+			i = skipQuoted(sql, i);
+			if (i == std::string::npos)
+				return false;
+			continue;
+		}
+		if (c == '(')
+			++depth;
+		else if (c == ')')
+			--depth;
+		else if (depth == 0 && matchWord(sql, i, "VALUES"))
+			head = i + 6;
+		else if (depth == 0 && (matchWord(sql, i, "SELECT") || matchWord(sql, i, "SET")))
+			return false;
+		++i;
+	}
+	if (head == 0)
+		return false;
+
+	rows = 0;
+	for (i = skipSpace(sql, head); ; i = skipSpace(sql, i + 1))
+	{
+		if (i >= sql.size() || sql[i] != '(')
+			return false;
+
+		for (depth = 0; i < sql.size(); )
+		{
+			char c = sql[i];
+			if (c == '\'' || c == '"' || c == '`')
+			{
+				i = skipQuoted(sql, i);
+				if (i == std::string::npos)
+					return false;
+				continue;
+			}
+			if (c == '(')
+				++depth;
+			else if (c == ')' && --depth == 0)
+				break;
+			++i;
+		}
+		if (i >= sql.size())
+			return false;
+		++rows;
+
+		// ON DUPLICATE KEY UPDATE and the like stay alone
+		i = skipSpace(sql, i + 1);
+		if (i == sql.size())
+			return true;
+		if (sql[i] != ',')
+			return false;
+	}
+}
+
+enum
+{
+	MAX_QUERY_GROUPS = 1024, // later ones go to "other"
+	MAX_GROUP_LENGTH = 256,  // of a group made from the sql
+};
+
+// stage histograms by query group and the slow query log. serial thread only
+struct QueryStats
+{
+	struct Group
 	{
-		assert(query_queue.empty());
+		utils::Histogram stages[QUERY_STAGE_COUNT];
+	};
 
+	std::unordered_map<std::string, std::unique_ptr<Group>> groups;
+	int64 slowQueryTime; // microsec, 0: off
+
+	QueryStats() : slowQueryTime(0) {}
+
+	// the sql with its values taken out: literals become ?, a list of them one ?, insert rows are cut
+	static std::string normalize(const std::string& sql)
+	{
+		std::string name;
+		for (size_t i = skipSpace(sql, 0); i < sql.size() && name.size() < MAX_GROUP_LENGTH;)
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			if (!follower_query_ && query_queue_.empty())
+			char c = sql[i];
+			if (c == '`')
+			{
+				size_t end = skipQuoted(sql, i);
+				if (end == std::string::npos) break;
+				name.append(sql, i, end - i);
+				i = end;
+				continue;
+			}
+			if (matchWord(sql, i, "VALUES"))
+			{
+				name += "VALUES ...";
+				break;
+			}
+			if (isspace((unsigned char)c))
+			{
+				if (!name.empty() && name.back() != ' ')
+					name += ' ';
+				++i;
+				continue;
+			}
+			if (isWordChar(c) && !isdigit((unsigned char)c))
+			{
+				while (i < sql.size() && isWordChar(sql[i]))
+					name += sql[i++];
+				continue;
+			}
+			if (c != '\'' && c != '"' && !isdigit((unsigned char)c))
 			{
-				cond_.wait(lock);
+				name += c;
+				++i;
+				continue;
 			}
 
-			if (follower_query_)
+			// a literal: string, or number like 12, 1.5, 0x1F, 1e5
+			if (c == '\'' || c == '"')
 			{
-				follower_query = follower_query_;
-				follower_query_.reset();
+				i = skipQuoted(sql, i);
+				if (i == std::string::npos) break;
 			}
-			if (!query_queue_.empty())
+			else
 			{
-				query_queue_.swap(query_queue);
+				while (i < sql.size() && (isWordChar(sql[i]) || sql[i] == '.'))
+					++i;
 			}
+
+			size_t size = name.size();
+			if (size >= 2 && name.compare(size - 2, 2, "?,") == 0)
+				name.resize(size - 1);
+			else if (size >= 3 && name.compare(size - 3, 3, "?, ") == 0)
+				name.resize(size - 2);
+			else
+				name += '?';
 		}
+		while (!name.empty() && name.back() == ' ')
+			name.pop_back();
+		return name;
+	}
+
+	Group* find(const Query& query)
+	{
+		std::string name = query.tag != nullptr ? std::string(query.tag) : normalize(query.sql);
+		auto it = groups.find(name);
+		if (it != groups.end())
+			return it->second.get();
+
+		if (groups.size() >= MAX_QUERY_GROUPS)
+			name = "other";
+		std::unique_ptr<Group>& group = groups[name];
+		if (group == nullptr)
+			group.reset(new Group());
+		return group.get();
+	}
 
-		while (!query_queue.empty())
+	// now: the handler is about to run
+	void record(const QueryNode& node, const ResultEvent& event, int64 now)
+	{
+		const Query& query = node.query;
+		int64 times[QUERY_STAGE_COUNT] =
+		{
+			event.started - node.postTime,
+			event.answered - event.started,
+			event.posted - event.answered,
+			now - event.posted,
+		};
+
+		Group* group = find(query);
+		for (int i = 0; i < QUERY_STAGE_COUNT; ++i)
+			group->stages[i].Record(times[i] > 0 ? uint64(times[i]) : 0);
+
+		int64 total = now - node.postTime;
+		if (slowQueryTime != 0 && total >= slowQueryTime)
 		{
-			handle_query(query_queue.front());
-			query_queue.pop_front();
+			LOG_WARN(nullptr, "slow query: " << total / 1000 << "ms, queue " << times[0] << "us, execute " << times[1]
+				<< "us, decode " << times[2] << "us, delay " << times[3] << "us, "
+				<< (query.tag != nullptr ? query.tag : "") << (query.tag != nullptr ? ": " : "")
+				<< normalize(query.sql)); // values may be player data or credentials
 		}
+	}
+};
 
-		if (follower_query != nullptr)
-		{
-			handle_query(follower_query);
-			follower_query.reset();
+void Worker::begin_query()
+{
+	started_ = nowMicro();
+	answered_ = started_;
+	timed_ = nullptr;
+}
+
+void Worker::run()
+{
+	utils::SetThreadAffinity(affinity_);
+	utils::SetThreadName("db");
 
-			on_query_finished(shared_from_this());
+	while (working_)
+	{
+		// bound queries first, they may be waiting on each other's order
+		QueryNode* node = bound_.pop();
+		if (node == nullptr)
+			node = dispatcher_->queue_.pop();
+
+		if (node == nullptr)
+		{
+			dispatcher_->wait(bound_, working_, std::chrono::milliseconds(100));
+			continue;
 		}
+
+		QueryPtr query(node);
+		int64 begin = nowMicro();
+		busySince_.store(begin, std::memory_order_relaxed);
+		addRelaxed(queries_, 1);
+
+		if (coalesce_ && coalescable(*query))
+			handle_coalesced(query);
+		else
+			handle_query(query);
+
+		busySince_.store(0, std::memory_order_relaxed);
+		addRelaxed(busyTime_, uint64(nowMicro() - begin));
+	}
+}
+
+// text protocol: "YYYY-MM-DD", "[-]HH:MM:SS" or "YYYY-MM-DD HH:MM:SS[.ffffff]"
+static void parseTime(const char* text, Time* t)
+{
+	memset(t, 0, sizeof(Time));
+	if (text == nullptr) return;
+
+	const char* p = text;
+	if (*p == '-')
+	{
+		t->reserve1 = 1; // MYSQL_TIME::neg
+		++p;
+	}
+	if (strchr(p, '-') != nullptr)
+	{
+		sscanf(p, "%u-%u-%u", &t->year, &t->month, &t->day);
+		p = strchr(p, ' ');
+		if (p == nullptr) return;
+		++p;
 	}
+	sscanf(p, "%u:%u:%u", &t->hour, &t->minute, &t->second);
+
+	const char* frac = strchr(p, '.');
+	if (frac == nullptr) return;
+	unsigned long scale = 100000;
+	for (++frac; *frac >= '0' && *frac <= '9' && scale != 0; ++frac, scale /= 10)
+		t->second_part += (*frac - '0') * scale;
+}
+
+// copies up to width bytes, zero filled
+static void copyBytes(char* buff, size_t width, const char* value, unsigned long length)
+{
+	size_t size = value != nullptr ? (length < width ? length : width) : 0;
+	if (size != 0)
+		memcpy(buff, value, size);
+	if (size < width)
+		memset(buff + size, 0, width - size);
 }
 
-size_t Worker::getField(MYSQL_FIELD* field, MYSQL_ROW row, char* buff)
+size_t Worker::getField(MYSQL_FIELD* field, const char* value, unsigned long length, char* buff)
 {
 	switch (field->type)
 	{
 	case MYSQL_TYPE_TINY:
 		if ((field->flags & UNSIGNED_FLAG) != 0)
-			*(uint8_t*)buff = static_cast<uint8_t>(*row != nullptr ? atoi(*row) : 0);
+			*(uint8_t*)buff = static_cast<uint8_t>(value != nullptr ? atoi(value) : 0);
 		else
-			*(int8_t*)buff = static_cast<int8_t>(*row != nullptr ? atoi(*row) : 0);
+			*(int8_t*)buff = static_cast<int8_t>(value != nullptr ? atoi(value) : 0);
 		return 1;
 
 	case MYSQL_TYPE_SHORT:
 		if ((field->flags & UNSIGNED_FLAG) != 0)
-			*(uint16_t*)buff = *row != nullptr ? (uint16_t)atoi(*row) : 0;
+			*(uint16_t*)buff = value != nullptr ? (uint16_t)atoi(value) : 0;
 		else
-			*(int16_t*)buff = *row != nullptr ? (int16_t)atoi(*row) : 0;
+			*(int16_t*)buff = value != nullptr ? (int16_t)atoi(value) : 0;
 		return 2;
 
 	case MYSQL_TYPE_LONG:
 		if ((field->flags & UNSIGNED_FLAG) != 0)
-			*(uint32_t*)buff = *row != nullptr ? (uint32_t)atoi(*row) : 0;
+			*(uint32_t*)buff = value != nullptr ? (uint32_t)atoi(value) : 0;
 		else
-			*(int32_t*)buff = *row != nullptr ? (uint32_t)atoi(*row) : 0;
+			*(int32_t*)buff = value != nullptr ? (uint32_t)atoi(value) : 0;
 		return 4;
 
 	case MYSQL_TYPE_LONGLONG:
-		
 		if ((field->flags & UNSIGNED_FLAG) != 0)
-			*(uint64_t*)buff = *row != nullptr ? (uint64_t)atoll(*row) : 0;
+			*(uint64_t*)buff = value != nullptr ? (uint64_t)atoll(value) : 0;
 		else
-			*(int64_t*)buff = *row != nullptr ? (int64_t)atoll(*row) : 0;
+			*(int64_t*)buff = value != nullptr ? (int64_t)atoll(value) : 0;
+		return 8;
+
+	case MYSQL_TYPE_FLOAT:
+		*(float*)buff = value != nullptr ? (float)atof(value) : 0.0f;
+		return 4;
+
+	case MYSQL_TYPE_DOUBLE:
+		*(double*)buff = value != nullptr ? atof(value) : 0.0;
 		return 8;
 
+	case MYSQL_TYPE_TIME:
+	case MYSQL_TYPE_DATE:
+	case MYSQL_TYPE_DATETIME:
+	case MYSQL_TYPE_TIMESTAMP:
+		parseTime(value, (Time*)buff);
+		return sizeof(Time);
+
+	case MYSQL_TYPE_STRING:
+	case MYSQL_TYPE_VAR_STRING:
+	case MYSQL_TYPE_BLOB:
+	{
+		// the value length comes from mysql_fetch_lengths(), max_length is 0 for a streamed result
+		size_t width = columnWidth(field);
+		copyBytes(buff, width, value, length);
+		return width;
+	}
+	}
+	return 0;
+}
+
+void Worker::handle_query(const QueryPtr& query)
+{
+	begin_query();
+	if (query->queryType == QueryType::Statement)
+	{
+		handle_statement(query);
+		return;
+	}
+
+	Result result;
+	result.queryType = query->queryType;
+	result.layout = query->layout;
+
+	result.error = mysql_real_query(&conn_, query->sql.c_str(), query->sql.length());
+	answered_ = nowMicro();
+	if (result.error != 0)
+	{
+		result.error = mysql_errno(&conn_);
+		// Errors
+		// 2014: CR_COMMANDS_OUT_OF_SYNC
+		// Commands were executed in an improper order.
+		// 2006: CR_SERVER_GONE_ERROR
+		// The MySQL server has gone away.
+		// 2013: CR_SERVER_LOST
+		// The connection to the server was lost during the query.
+		// 2000: CR_UNKNOWN_ERROR
+		// An unknown error occurred.
+
+		if (query->handler)
+			post_result(new_result_event(query), result);
+
+		return;
+	}
+
+	if (mysql_field_count(&conn_) != 0)
+	{
+		// Select
+		if (query->queryType != QueryType::BatchQuery)
+		{
+			do
+			{
+				auto* res = mysql_store_result(&conn_);
+				answered_ = nowMicro();
+				if (res == nullptr) continue;
+
+				uint fieldCount = mysql_num_fields(res);
+				MYSQL_FIELD* fields = mysql_fetch_fields(res);
+				ResultEventPtr event = new_result_event(query);
+
+				result.fields = nullptr;
+				result.prefetchRows = query->prefetchRows;
+				result.rowCount = (int)mysql_num_rows(res);
+				result.rowSize = (int)buildColumns(fields, fieldCount, query->layout, event->columns);
+
+				size_t buffSize = placeColumns(query->layout, event->columns, result.rowCount, result.rowSize);
+				if (buffSize != 0)
+					event->buff.assign(buffSize, 0);
+
+				int finishedRow = 0;
+				while (auto row = mysql_fetch_row(res))
+				{
+					if (result.rowCount <= finishedRow)
+						break;
+
+					putRow(event->columns, query->layout, fields, row, mysql_fetch_lengths(res), event->buff, finishedRow, result.rowSize);
+					++finishedRow;
+				}
+
+				post_result(std::move(event), result);
+
+				mysql_free_result(res);
+
+				// more results? -1 = no, >0 = error, 0 = yes (keep looping)
+			} while (mysql_next_result(&conn_) == 0);
+		}
+		else
+		{
+			// streamed: rows are read as the server sends them and posted in chunks of prefetchRows.
+			// the worker waits while streamWindow chunks are still queued on the serial,
+			// so memory stays at window * chunk size whatever the size of the result set
+			do
+			{
+				auto* res = mysql_use_result(&conn_);
+				if (res == nullptr) continue;
+
+				if (query->prefetchRows <= 0)
+					query->prefetchRows = DEFAULT_PREFETCH_ROWS;
+
+				uint fieldCount = mysql_num_fields(res);
+				MYSQL_FIELD* fields = mysql_fetch_fields(res);
+				std::vector<Column> columns;
+
+				result.fields = nullptr;
+				result.prefetchRows = query->prefetchRows;
+				result.rowSize = (int)buildColumns(fields, fieldCount, query->layout, columns);
+				result.rowCount = 0;
+
+				size_t chunkSize = placeColumns(query->layout, columns, query->prefetchRows, result.rowSize);
+
+				ResultEventPtr event;
+				while (auto row = mysql_fetch_row(res))
+				{
+					if (!event)
+					{
+						// stopping: the rest is dropped by mysql_free_result()
+						if (!window_->Acquire(query->streamWindow, working_))
+							break;
+
+						event = new_result_event(query);
+						event->window = window_;
+						event->columns = columns;
+						event->buff.assign(chunkSize, 0);
+						result.rowCount = 0;
+					}
+
+					putRow(event->columns, query->layout, fields, row, mysql_fetch_lengths(res), event->buff, result.rowCount, result.rowSize);
+
+					if (++result.rowCount == query->prefetchRows)
+						post_result(std::move(event), result);
+				}
+
+				if (event && result.rowCount != 0)
+					post_result(std::move(event), result);
+				event.reset();
+
+				// end of the result set, with the error if the stream broke off
+				result.error = (int)mysql_errno(&conn_);
+				result.rowCount = 0;
+				result.data = nullptr;
+				post_result(new_result_event(query), result);
+
+				mysql_free_result(res);
+
+				// more results? -1 = no, >0 = error, 0 = yes (keep looping)
+			} while (mysql_next_result(&conn_) == 0);
+		}
+	}
+	else
+	{
+		// Update
+		result.effected = mysql_affected_rows(&conn_);
+
+		if (query->handler)
+			post_result(new_result_event(query), result);
+
+		// results past the first are dropped
+		while (mysql_next_result(&conn_) == 0)
+		{
+			MYSQL_RES* res = mysql_store_result(&conn_);
+			if (res != nullptr)
+				mysql_free_result(res);
+		}
+	}
+}
+
+void Worker::handle_coalesced(const QueryPtr& first)
+{
+	std::vector<QueryPtr>& batch = batch_;
+	batch.push_back(first);
+
+	// a query that can't join runs right after the batch
+	QueryPtr other;
+	size_t bytes = first->sql.size();
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(coalesceWindow_);
+	while (batch.size() < coalesceMax_ && bytes < COALESCE_MAX_BYTES)
+	{
+		QueryNode* node = dispatcher_->queue_.pop();
+		if (node == nullptr)
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline || !working_ || !bound_.empty())
+				break;
+			dispatcher_->wait(bound_, working_, deadline - now);
+			continue;
+		}
+
+		QueryPtr query(node);
+		addRelaxed(queries_, 1);
+		if (!coalescable(*query))
+		{
+			other = std::move(query);
+			break;
+		}
+		bytes += query->sql.size();
+		batch.push_back(std::move(query));
+	}
+
+	if (batch.size() == 1)
+		handle_query(batch[0]);
+	else
+		execute_batch(batch);
+	batch.clear();
+
+	if (other)
+		handle_query(other);
+}
+
+// an error caused by the key of one row, the other rows of a multi-row insert are fine
+static bool keyError(int error)
+{
+	return error == 1062  // ER_DUP_ENTRY
+		|| error == 1586  // ER_DUP_ENTRY_WITH_KEY_NAME
+		|| error == 1216  // ER_NO_REFERENCED_ROW
+		|| error == 1452; // ER_NO_REFERENCED_ROW_2
+}
+
+void Worker::execute_batch(std::vector<QueryPtr>& batch)
+{
+	// one statement of the round trip: a query, or consecutive inserts merged into one.
+	// any other statement closes the group, so nothing moves past it
+	struct Unit
+	{
+		size_t head; // 0: not merged
+		std::vector<size_t> queries;
+	};
+
+	std::vector<Unit> units;
+	std::vector<size_t> rows(batch.size(), 0);
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		const std::string& sql = batch[i]->sql;
+		size_t head = 0;
+		if (!parseInsert(sql, head, rows[i]))
+		{
+			head = 0; // may be set by a statement that turned out not mergeable
+		}
+		else if (!units.empty())
+		{
+			Unit& last = units.back();
+			if (last.head == head && batch[last.queries[0]]->sql.compare(0, head, sql, 0, head) == 0)
+			{
+				last.queries.push_back(i);
+				continue;
+			}
+		}
+
+		Unit unit;
+		unit.head = head;
+		unit.queries.push_back(i);
+		units.push_back(std::move(unit));
+	}
+
+	// multi statements are on for this round trip only, other queries can't chain statements
+	if (mysql_set_server_option(&conn_, MYSQL_OPTION_MULTI_STATEMENTS_ON) != 0)
+	{
+		for (size_t i = 0; i < batch.size(); ++i)
+			handle_query(batch[i]);
+		return;
+	}
+
+	std::string sql;
+	for (size_t u = 0; u < units.size(); ++u)
+	{
+		if (u != 0)
+			sql += ";\n";
+		const Unit& unit = units[u];
+		sql += batch[unit.queries[0]]->sql;
+		for (size_t k = 1; k < unit.queries.size(); ++k)
+		{
+			const std::string& more = batch[unit.queries[k]]->sql;
+			sql += ',';
+			sql.append(more, unit.head, std::string::npos);
+		}
+	}
+
+	// statements after a failed one are not run by the server
+	begin_query();
+	int status = mysql_real_query(&conn_, sql.c_str(), sql.length());
+	answered_ = nowMicro();
+	size_t u = 0;
+	for (; u < units.size() && status == 0; ++u)
+	{
+		// an execute returning rows has them dropped
+		MYSQL_RES* res = mysql_store_result(&conn_);
+		if (res != nullptr)
+			mysql_free_result(res);
+
+		const Unit& unit = units[u];
+		int64 effected = mysql_affected_rows(&conn_);
+		for (size_t k = 0; k < unit.queries.size(); ++k)
+		{
+			const QueryPtr& query = batch[unit.queries[k]];
+			if (!query->handler) continue;
+
+			Result result;
+			result.queryType = query->queryType;
+			result.layout = query->layout;
+			result.error = 0;
+			// a merged insert reports each query its own rows
+			result.effected = unit.queries.size() > 1 ? (int64)rows[unit.queries[k]] : effected;
+			post_result(new_result_event(query), result);
+		}
+
+		// -1 = no more results, >0 = error of the next statement
+		if (u + 1 < units.size())
+			status = mysql_next_result(&conn_);
+	}
+
+	int error = status > 0 ? (int)mysql_errno(&conn_) : 2014; // CR_COMMANDS_OUT_OF_SYNC
+	while (mysql_next_result(&conn_) == 0)
+	{
+		MYSQL_RES* res = mysql_store_result(&conn_);
+		if (res != nullptr)
+			mysql_free_result(res);
+	}
+	mysql_set_server_option(&conn_, MYSQL_OPTION_MULTI_STATEMENTS_OFF);
+
+	if (u == units.size())
+		return;
+
+	// the server may have run anything after a lost connection, nothing is sent again
+	bool lost = error == 2006 || error == 2013; // CR_SERVER_GONE_ERROR, CR_SERVER_LOST
+
+	// a merged insert failed by one row's key runs again query by query, so only the caller
+	// of that row gets the error. a table without transactions kept the rows before it,
+	// those fail on their own key. any other error goes to every query of the statement
+	const Unit& failed = units[u];
+	bool rerun = !lost && failed.queries.size() > 1 && keyError(error);
+	for (size_t k = 0; k < failed.queries.size(); ++k)
+	{
+		const QueryPtr& query = batch[failed.queries[k]];
+		if (rerun)
+		{
+			handle_query(query);
+			continue;
+		}
+		post_error(query, error);
+	}
+	++u;
+
+	// the statements after it weren't run
+	for (; u < units.size(); ++u)
+	{
+		for (size_t k = 0; k < units[u].queries.size(); ++k)
+		{
+			const QueryPtr& query = batch[units[u].queries[k]];
+			if (lost)
+				post_error(query, error);
+			else
+				handle_query(query);
+		}
+	}
+}
+
+void Worker::post_error(const QueryPtr& query, int error)
+{
+	if (!query->handler) return;
+
+	Result result;
+	result.queryType = query->queryType;
+	result.layout = query->layout;
+	result.error = error;
+	post_result(new_result_event(query), result);
+}
+
+static bool isBytes(ValueType type)
+{
+	return type == ValueType::String || type == ValueType::Blob;
+}
+
+static ValueType valueType(MYSQL_FIELD* field)
+{
+	bool binary = (field->flags & BINARY_FLAG) != 0;
+	switch (field->type)
+	{
+	case MYSQL_TYPE_TINY:     return ValueType::Int8;
+	case MYSQL_TYPE_SHORT:    return ValueType::Int16;
+	case MYSQL_TYPE_LONG:     return ValueType::Int32;
+	case MYSQL_TYPE_LONGLONG: return ValueType::Int64;
+	case MYSQL_TYPE_FLOAT:    return ValueType::Float;
+	case MYSQL_TYPE_DOUBLE:   return ValueType::Double;
+
+	case MYSQL_TYPE_TIME:
+	case MYSQL_TYPE_DATE:
+	case MYSQL_TYPE_DATETIME:
+	case MYSQL_TYPE_TIMESTAMP:
+		return ValueType::Time;
+
+	case MYSQL_TYPE_STRING:
+	case MYSQL_TYPE_VAR_STRING:
+	case MYSQL_TYPE_BLOB:
+		return binary ? ValueType::Blob : ValueType::String;
+
+	default:
+		return ValueType::Null;
+	}
+}
+
+size_t Worker::buildColumns(MYSQL_FIELD* fields, uint count, RowLayout layout, std::vector<Column>& columns)
+{
+	size_t rowSize = 0;
+	columns.resize(count);
+	for (uint i = 0; i < count; ++i)
+	{
+		Column& column = columns[i];
+		column.type = valueType(&fields[i]);
+		column.isUnsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+		column.offset = (uint32)rowSize;
+		column.nulls = 0;
+		if (layout != RowLayout::Fixed && isBytes(column.type))
+			column.width = sizeof(BytesRef);
+		else
+			column.width = (uint32)columnWidth(&fields[i]);
+		rowSize += column.width;
+	}
+	return rowSize;
+}
+
+// columnar arrays start 16 byte aligned
+enum { COLUMN_ALIGN = 16 };
+
+size_t Worker::placeColumns(RowLayout layout, std::vector<Column>& columns, size_t rows, size_t rowSize)
+{
+	if (layout != RowLayout::Columnar)
+		return rows * rowSize;
+	if (rows == 0)
+		return 0;
+
+	size_t size = 0;
+	for (size_t i = 0; i < columns.size(); ++i)
+	{
+		Column& column = columns[i];
+		column.offset = (uint32)size;
+		size += rows * column.width;
+		column.nulls = (uint32)size;
+		size += (rows + 7) / 8;
+		size = (size + COLUMN_ALIGN - 1) & ~size_t(COLUMN_ALIGN - 1);
+	}
+	return size;
+}
+
+static size_t fieldOffset(RowLayout layout, const Column& column, size_t row, size_t rowSize)
+{
+	if (layout == RowLayout::Columnar)
+		return column.offset + row * column.width;
+	return row * rowSize + column.offset;
+}
+
+static void setNull(std::vector<char>& buff, const Column& column, size_t row)
+{
+	buff[column.nulls + row / 8] |= char(1 << (row % 8));
+}
+
+// appends the bytes and writes their BytesRef at buff[at]
+static void putBytes(std::vector<char>& buff, size_t at, const char* value, unsigned long length)
+{
+	BytesRef ref = { (uint32)buff.size(), (uint32)length };
+	if (length != 0)
+		buff.insert(buff.end(), value, value + length);
+	memcpy(&buff[at], &ref, sizeof(ref));
+}
+
+void Worker::putRow(const std::vector<Column>& columns, RowLayout layout, MYSQL_FIELD* fields, MYSQL_ROW row, unsigned long* lengths, std::vector<char>& buff, size_t rowIndex, size_t rowSize)
+{
+	for (size_t i = 0; i < columns.size(); ++i)
+	{
+		const Column& column = columns[i];
+		if (row[i] == nullptr && layout == RowLayout::Columnar)
+			setNull(buff, column, rowIndex);
+		if (column.width == 0) continue;
+
+		size_t at = fieldOffset(layout, column, rowIndex, rowSize);
+		if (layout != RowLayout::Fixed && isBytes(column.type))
+			putBytes(buff, at, row[i], row[i] != nullptr ? lengths[i] : 0);
+		else
+			getField(&fields[i], row[i], lengths[i], &buff[at]);
+	}
+}
+
+size_t Worker::columnWidth(MYSQL_FIELD* field)
+{
+	switch (field->type)
+	{
+	case MYSQL_TYPE_TINY:
+		return 1;
+
+	case MYSQL_TYPE_SHORT:
+		return 2;
+
+	case MYSQL_TYPE_LONG:
 	case MYSQL_TYPE_FLOAT:
-		*(float*)buff = *row != nullptr ? (float)atof(*row) : 0.0f;
 		return 4;
 
+	case MYSQL_TYPE_LONGLONG:
 	case MYSQL_TYPE_DOUBLE:
-		*(double*)buff = *row != nullptr ? atof(*row) : 0.0;
 		return 8;
 
 	case MYSQL_TYPE_TIME:
-		if (*row != nullptr)
-			memcpy(buff, *row, sizeof(Time));
-		else
-			memset(buff, 0, sizeof(Time));
-		return sizeof(Time);
-
 	case MYSQL_TYPE_DATE:
-		if (*row != nullptr)
-			memcpy(buff, *row, sizeof(Time));
-		else
-			memset(buff, 0, sizeof(Time));
-		return sizeof(Time);
-
 	case MYSQL_TYPE_DATETIME:
-		if (*row != nullptr)
-			memcpy(buff, *row, sizeof(Time));
-		else
-			memset(buff, 0, sizeof(Time));
-		return sizeof(Time);
-
 	case MYSQL_TYPE_TIMESTAMP:
-		if (*row != nullptr)
-			memcpy(buff, *row, sizeof(Time));
-		else
-			memset(buff, 0, sizeof(Time));
 		return sizeof(Time);
 
 	case MYSQL_TYPE_STRING:
 	case MYSQL_TYPE_VAR_STRING:
 		// data length
 		if ((field->flags & BINARY_FLAG) != 0)
-		{
-			if (*row != nullptr)
-			{
-				// max_length
-				// Խϵֶε(ʵڽееֵֶĳ)
-				// ʹmysql_store_result() mysql_list_fields()
-				// ֶ󳤶ȡʹmysql_use_result()ֵ㡣
-				memcpy(buff, *row, field->max_length);
-				if (field->max_length < field->length)
-				{
-					memset(buff + field->max_length, 0, field->length - field->max_length);
-				}
-			}
-			else
-			{
-				memset(buff, 0, field->length);
-			}
 			return field->length;
-		}
 		else
-		{
-			if (*row != nullptr)
-			{
-				memcpy(buff, *row, field->max_length);
-				if (field->max_length < field->length)
-				{
-					memset(buff + field->max_length, 0, field->length / 3 + 1 - field->max_length);
-				}
-			}
-			else
-			{
-				memset(buff, 0, (field->length / 3) + 1);
-			}
-			return (field->length / 3) + 1;
-		}
-		break;
+			return field->length / 3 + 1;
 
 	case MYSQL_TYPE_BLOB:
 		// data_length
-		if (*row != nullptr)
-			memcpy(buff, *row, field->length);
-		else
-			memset(buff, 0, field->length);
 		return field->length;
+
+	default:
+		return 0;
 	}
-	return 0;
 }
 
-void Worker::handle_query(QueryPtr query)
+// time: converted into `time`, which is bound instead of the value
+static void bindParam(MYSQL_BIND& bind, MYSQL_TIME& time, const Params& params, size_t index)
 {
-	Result result;
-	result.queryType = query->queryType;
+	const Params::Param& param = params[index];
+	memset(&bind, 0, sizeof(bind));
+	bind.buffer = const_cast<char*>(params.Data(param));
+	bind.buffer_length = param.length;
+	bind.is_unsigned = param.isUnsigned;
 
-	result.error = mysql_real_query(&conn_, query->sql.c_str(), query->sql.length());
-	if (result.error != 0)
+	switch (param.type)
 	{
-		result.error = mysql_errno(&conn_);
-		// Errors
-		// 2014: CR_COMMANDS_OUT_OF_SYNC
-		// Commands were executed in an improper order.
-		// 2006: CR_SERVER_GONE_ERROR
-		// The MySQL server has gone away.
-		// 2013: CR_SERVER_LOST
-		// The connection to the server was lost during the query.
-		// 2000: CR_UNKNOWN_ERROR
-		// An unknown error occurred.
+	case ValueType::Null:   bind.buffer_type = MYSQL_TYPE_NULL;     break;
+	case ValueType::Int8:   bind.buffer_type = MYSQL_TYPE_TINY;     break;
+	case ValueType::Int16:  bind.buffer_type = MYSQL_TYPE_SHORT;    break;
+	case ValueType::Int32:  bind.buffer_type = MYSQL_TYPE_LONG;     break;
+	case ValueType::Int64:  bind.buffer_type = MYSQL_TYPE_LONGLONG; break;
+	case ValueType::Float:  bind.buffer_type = MYSQL_TYPE_FLOAT;    break;
+	case ValueType::Double: bind.buffer_type = MYSQL_TYPE_DOUBLE;   break;
+	case ValueType::String: bind.buffer_type = MYSQL_TYPE_STRING;   break;
+	case ValueType::Blob:   bind.buffer_type = MYSQL_TYPE_BLOB;     break;
+	case ValueType::Time:
+	{
+		Time value;
+		memcpy(&value, params.Data(param), sizeof(value));
+		toMysqlTime(value, time);
+		bind.buffer_type = MYSQL_TYPE_DATETIME;
+		bind.buffer = &time;
+		bind.buffer_length = sizeof(time);
+		break;
+	}
+	}
+}
 
-		if (query->handler)
-			serial.Post(std::bind(query->handler, result));
+Statement* Worker::get_statement(const std::string& sql, int& error)
+{
+	auto it = statements_.find(sql);
+	if (it != statements_.end())
+		return it->second.get();
 
-		return;
+	std::unique_ptr<Statement> statement(new Statement());
+	statement->stmt = mysql_stmt_init(&conn_);
+	if (statement->stmt == nullptr)
+	{
+		error = mysql_errno(&conn_);
+		return nullptr;
 	}
 
-	if (mysql_field_count(&conn_) != 0)
+	if (mysql_stmt_prepare(statement->stmt, sql.c_str(), (ulong)sql.length()) != 0)
 	{
-		// Select
-		if (query->queryType != QueryType::BatchQuery)
-		{
-			do
-			{
-				auto* res = mysql_store_result(&conn_);
-				if (res == nullptr) continue;
-
-				result.fields = nullptr;
-				result.prefetchRows = query->prefetchRows;
-				result.rowCount = (int)mysql_num_rows(res);
-				result.rowSize = calcRowSize(res);
-
-				std::shared_ptr<std::vector<char> > buff_;
-				size_t buffSize = result.rowCount * result.rowSize;
-				if (buffSize != 0)
-				{
-					buff_.reset(new std::vector<char>(buffSize));
-					memset(&(*buff_)[0], 0, buffSize);
-					result.data = &(*buff_)[0];
-				}
-
-				int finishedRow = 0;
-				size_t index = 0;
-				while (auto row = mysql_fetch_row(res))
-				{
-					if (result.rowCount <= finishedRow)
-						break;
-
-					mysql_field_seek(res, 0);
-					while (auto* field = mysql_fetch_field(res))
-					{
-						if (index >= buffSize)
-						{
-							assert(false);
-							return;
-						}
-						index += getField(field, row, &(*buff_)[index]);
-						++row;
-					}
-
-					++finishedRow;
-				}
-
-				serial.Post(std::bind(&Worker::handle_result, shared_from_this(), query, result, buff_));
+		error = mysql_stmt_errno(statement->stmt);
+		return nullptr;
+	}
 
-				mysql_free_result(res);
+	statement->params.resize(mysql_stmt_param_count(statement->stmt));
+	statement->paramTimes.resize(statement->params.size());
 
-				// more results? -1 = no, >0 = error, 0 = yes (keep looping)
-			} while (mysql_next_result(&conn_) == 0);
-		}
-		else
+	statement->meta = mysql_stmt_result_metadata(statement->stmt);
+	if (statement->meta != nullptr)
+	{
+		uint count = mysql_num_fields(statement->meta);
+		MYSQL_FIELD* fields = mysql_fetch_fields(statement->meta);
+		statement->columns.resize(count);
+		statement->columnTimes.resize(count);
+		for (uint i = 0; i < count; ++i)
 		{
-			do
-			{
-				auto* res = mysql_store_result(&conn_);
-				if (res == nullptr) continue;
-
-				if (query->prefetchRows == 0)
-					query->prefetchRows = DEFAULT_PREFETCH_ROWS;
-
-				int row_count = (int)mysql_num_rows(res);
-
-				result.fields = nullptr;
-				result.prefetchRows = query->prefetchRows;
-				result.rowCount = row_count;
-				result.rowSize = calcRowSize(res);
-
-				if (result.rowCount > query->prefetchRows)
-					result.rowCount = query->prefetchRows;
-
-				//char* buff_ = nullptr;
-				std::shared_ptr<std::vector<char> > buff_;
-				size_t buffSize = result.rowCount * result.rowSize;
-				if (buffSize != 0)
-				{
-					buff_.reset(new std::vector<char>(buffSize));
-					memset(&(*buff_)[0], 0, buffSize);
-					result.data = &(*buff_)[0];
-				}
-
-				int finishedRow = 0;
-				size_t index = 0;
-				while (auto row = mysql_fetch_row(res))
-				{
-					if (row_count <= finishedRow) break;
-
-					mysql_field_seek(res, 0);
-					while (auto* field = mysql_fetch_field(res))
-					{
-						if (index >= buffSize)
-						{
-							assert(false);
-							return;
-						}
-
-						index += getField(field, row, &(*buff_)[index]);
-						++row;
-					}
+			// columns the row layout skips are fetched into nothing
+			MYSQL_BIND& bind = statement->columns[i];
+			memset(&bind, 0, sizeof(bind));
+			bind.buffer_type = columnWidth(&fields[i]) != 0 ? fields[i].type : MYSQL_TYPE_NULL;
+			bind.is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+			bind.is_null = &bind.is_null_value;
+			bind.length = &bind.length_value;
+			bind.error = &bind.error_value;
+		}
+	}
 
-					++finishedRow;
-					if (finishedRow % query->prefetchRows == 0)
-					{
-						serial.Post(std::bind(&Worker::handle_result, shared_from_this(), query, result, buff_));
-
-						assert(finishedRow <= row_count);
-						int leftRow = row_count - finishedRow;
-						result.rowCount = query->prefetchRows < leftRow ? query->prefetchRows : leftRow;
-						size_t buffSize = result.rowCount * result.rowSize;
-						if (buffSize != 0)
-						{
-							buff_.reset(new std::vector<char>(buffSize));
-							memset(&(*buff_)[0], 0, buffSize);
-							result.data = &(*buff_)[0];
-						}
-						index = 0;
-					}
-				}
+	Statement* ret = statement.get();
+	statements_[sql] = std::move(statement);
+	return ret;
+}
 
-				if (result.rowCount != 0 && finishedRow % query->prefetchRows != 0)
-				{
-					serial.Post(std::bind(&Worker::handle_result, shared_from_this(), query, result, buff_));
-				}
+void Worker::handle_statement(const QueryPtr& query)
+{
+	Result result;
+	result.error = 0;
+	result.queryType = query->queryType;
+	result.effected = 0;
+	result.rowCount = 0;
+	result.rowSize = 0;
+	result.data = nullptr;
+	result.fields = nullptr;
+	result.prefetchRows = query->prefetchRows;
+	result.layout = query->layout;
+
+	Statement* statement = get_statement(query->sql, result.error);
+	if (statement == nullptr)
+	{
+		if (query->handler)
+			post_result(new_result_event(query), result);
+		return;
+	}
 
-				result.rowCount = 0;
-				result.data = nullptr;
-				serial.Post(std::bind(&Worker::handle_result, shared_from_this(), query, result, nullptr));
+	const Params& params = query->params;
+	if (params.Size() != statement->params.size())
+	{
+		result.error = 2034; // CR_INVALID_PARAMETER_NO
+		if (query->handler)
+			post_result(new_result_event(query), result);
+		return;
+	}
 
-				mysql_free_result(res);
+	for (size_t i = 0; i < params.Size(); ++i)
+		bindParam(statement->params[i], statement->paramTimes[i], params, i);
 
-				// more results? -1 = no, >0 = error, 0 = yes (keep looping)
-			} while (mysql_next_result(&conn_) == 0);
-		}
+	MYSQL_STMT* stmt = statement->stmt;
+	bool failed = (!statement->params.empty() && mysql_stmt_bind_param(stmt, &statement->params[0]) != 0)
+		|| mysql_stmt_execute(stmt) != 0
+		|| (statement->meta != nullptr && mysql_stmt_store_result(stmt) != 0);
+	answered_ = nowMicro();
+	if (failed)
+	{
+		result.error = mysql_stmt_errno(stmt);
+		// prepared again next time, the connection may have been reset
+		statements_.erase(query->sql);
+		if (query->handler)
+			post_result(new_result_event(query), result);
+		return;
 	}
-	else
+
+	if (statement->meta == nullptr)
 	{
 		// Update
-		result.effected = mysql_affected_rows(&conn_);
-
+		result.effected = (int64)mysql_stmt_affected_rows(stmt);
 		if (query->handler)
-			serial.Post(std::bind(query->handler, result));
+			post_result(new_result_event(query), result);
+		return;
 	}
-}
-
-size_t Worker::calcRowSize(MYSQL_RES* res)
-{
-	assert(res != nullptr);
 
-	size_t rowSize = 0;
+	// Select
+	ResultEventPtr event = new_result_event(query);
+	std::vector<Column>& columns = event->columns;
+	result.rowCount = (int)mysql_stmt_num_rows(stmt);
+	result.rowSize = (int)buildColumns(mysql_fetch_fields(statement->meta), mysql_num_fields(statement->meta), query->layout, columns);
+
+	RowLayout layout = query->layout;
+	size_t buffSize = placeColumns(layout, columns, result.rowCount, result.rowSize);
+	if (buffSize != 0)
+		event->buff.assign(buffSize, 0);
+
+	// packed strings and blobs are fetched with an empty buffer for their length,
+	// then copied after the rows with mysql_stmt_fetch_column()
+	bool packed = layout != RowLayout::Fixed;
+	std::vector<MYSQL_BIND>& binds = statement->columns;
+	for (size_t i = 0; i < binds.size(); ++i)
+	{
+		if (columns[i].type == ValueType::Time && columns[i].width != 0)
+			binds[i].buffer_length = sizeof(MYSQL_TIME);
+		else
+			binds[i].buffer_length = packed && isBytes(columns[i].type) ? 0 : columns[i].width;
+	}
 
-	mysql_field_seek(res, 0);
-	while (MYSQL_FIELD* field = mysql_fetch_field(res))
+	// each row is fetched in place: the column buffers are moved to the next row before every fetch.
+	// NULL leaves the zeroed bytes, a truncated fixed string keeps what fits
+	int finishedRow = 0;
+	while (finishedRow < result.rowCount && buffSize != 0)
 	{
-		switch (field->type)
+		for (size_t i = 0; i < binds.size(); ++i)
 		{
-		case MYSQL_TYPE_TINY:
-			rowSize += 1;
-			break;
-
-		case MYSQL_TYPE_SHORT:
-			rowSize += 2;
-			break;
+			size_t at = fieldOffset(layout, columns[i], finishedRow, result.rowSize);
+			if (columns[i].type == ValueType::Time && binds[i].buffer_length != 0)
+				binds[i].buffer = &statement->columnTimes[i];
+			else
+				binds[i].buffer = binds[i].buffer_length != 0 ? &event->buff[at] : nullptr;
+		}
+		mysql_stmt_bind_result(stmt, &binds[0]);
 
-		case MYSQL_TYPE_LONG:
-		case MYSQL_TYPE_FLOAT:
-			rowSize += 4;
-			break;
+		int ret = mysql_stmt_fetch(stmt);
+		if (ret != 0 && ret != MYSQL_DATA_TRUNCATED) break;
 
-		case MYSQL_TYPE_LONGLONG:
-		case MYSQL_TYPE_DOUBLE:
-			rowSize += 8;
-			break;
+		for (size_t i = 0; layout == RowLayout::Columnar && i < binds.size(); ++i)
+		{
+			if (binds[i].is_null_value)
+				setNull(event->buff, columns[i], finishedRow);
+		}
 
-		case MYSQL_TYPE_TIME:
-		case MYSQL_TYPE_DATE:
-		case MYSQL_TYPE_DATETIME:
-		case MYSQL_TYPE_TIMESTAMP:
-			rowSize += sizeof(Time);
-			break;
+		for (size_t i = 0; i < binds.size(); ++i)
+		{
+			if (columns[i].type != ValueType::Time || binds[i].buffer_length == 0 || binds[i].is_null_value) continue;
 
-		case MYSQL_TYPE_STRING:
-		case MYSQL_TYPE_VAR_STRING:
-			// data length
-			if ((field->flags & BINARY_FLAG) != 0)
-				rowSize += field->length;
-			else
-				rowSize += field->length / 3 + 1;
-			break;
+			Time value;
+			fromMysqlTime(statement->columnTimes[i], value);
+			memcpy(&event->buff[fieldOffset(layout, columns[i], finishedRow, result.rowSize)], &value, sizeof(value));
+		}
 
-		case MYSQL_TYPE_BLOB:
-			// data_length
-			rowSize += field->length;
-			break;
+		for (size_t i = 0; packed && i < binds.size(); ++i)
+		{
+			if (!isBytes(columns[i].type)) continue;
 
-		default:
-			break;
+			unsigned long length = binds[i].is_null_value ? 0 : binds[i].length_value;
+			BytesRef ref = { (uint32)event->buff.size(), (uint32)length };
+			if (length != 0)
+			{
+				event->buff.resize(ref.offset + length);
+				MYSQL_BIND bind = binds[i];
+				bind.buffer = &event->buff[ref.offset];
+				bind.buffer_length = length;
+				mysql_stmt_fetch_column(stmt, &bind, (uint)i, 0);
+			}
+			memcpy(&event->buff[fieldOffset(layout, columns[i], finishedRow, result.rowSize)], &ref, sizeof(ref));
 		}
+		++finishedRow;
 	}
-	return rowSize;
+	if (buffSize != 0)
+		result.rowCount = finishedRow;
+
+	mysql_stmt_free_result(stmt);
+	post_result(std::move(event), result);
 }
 
-void Worker::handle_result(QueryPtr query, Result result, std::shared_ptr<std::vector<char> > buff)
+ResultEventPtr Worker::new_result_event(const QueryPtr& query)
 {
-	if (query->handler)
-		query->handler(result);
-
-	buff.reset();
-	//if (buff != nullptr)
-	//	delete []buff;
+	ResultEventPtr event(ResultEventPool::Alloc());
+	event->query = query;
+	event->started = started_;
+	event->answered = answered_;
+	// a query is timed by its first result
+	if (stats_ && timed_ != query.get())
+	{
+		event->stats = stats_;
+		timed_ = query.get();
+	}
+	return event;
 }
 
-/////////////////////////////////////////////////////////////////////////////
-struct Accessor::Core : public std::enable_shared_from_this<Accessor::Core>
+void Worker::post_result(ResultEventPtr event, const Result& result)
 {
-	typedef std::vector<Worker::Ptr> Workders;
-	typedef std::list<Worker::Ptr> FollowersQueue;
-	typedef std::list<QueryPtr> QueryQueue;
-
-	Workders workers_;
-	FollowersQueue followers_queue_;
-	QueryQueue query_queue_;
-
-	// ʱԼquery_queue_mutex_Ȼworker_mutex_
-	std::mutex query_queue_mutex_;
-	std::mutex worker_mutex_;
-
-	void on_query_finished(Worker::Ptr worker);
-
-	void post_query_to_follower();
-
-	Worker::QueryFinishedHandlerType GetQueryFinishedHandler();
-};
-
-/////////////////////////////////////////////////////////////////////////////
+	event->result = result;
+	// compact rows may have grown the buffer after the caller took result.data
+	event->result.data = event->buff.empty() ? nullptr : &event->buff[0];
+	event->result.dataSize = event->buff.size();
+	event->result.columnCount = (int)event->columns.size();
+	event->result.columns = event->columns.empty() ? nullptr : &event->columns[0];
+	if (event->stats)
+		event->posted = nowMicro();
+	// batch chunks yield to player input and normal results
+	Serial::Priority priority = result.queryType == QueryType::BatchQuery ? Serial::Priority::Bulk : Serial::Priority::Normal;
+	// function pointer + one pointer, stored inline by the serial
+	serial.Post(std::bind(&Worker::handle_result, std::move(event)), Serial::PostTag::DBResult, priority);
+}
 
-void Accessor::Core::on_query_finished(Worker::Ptr worker)
+void Worker::handle_result(ResultEventPtr& event)
 {
+	QueryNode* node = event->query.get();
+	std::vector<ResultHandler> waiters;
+	if (node->flights)
 	{
-		std::lock_guard<std::mutex> guard(worker_mutex_);
-		followers_queue_.push_back(worker);
+		// later identical selects now start their own query
+		std::lock_guard<std::mutex> guard(node->flights->mutex);
+		node->flights->queries.erase(Flights::key(node->query));
+		waiters.swap(node->waiters);
 	}
-	post_query_to_follower();
-}
 
-void Accessor::Core::post_query_to_follower()
-{
-	std::lock_guard<std::mutex> guard1(query_queue_mutex_);
-	std::lock_guard<std::mutex> guard2(worker_mutex_);
+	if (event->stats)
+		event->stats->record(*node, *event, nowMicro());
 
-	while (!followers_queue_.empty() && !query_queue_.empty())
-	{
-		auto worker = followers_queue_.front();
-		auto query = query_queue_.front();
-		followers_queue_.pop_front();
-		query_queue_.pop_front();
+	if (node->query.handler)
+		node->query.handler(event->result);
 
-		worker->post(query);
-	}
+	// all of them read the same buffer
+	for (size_t i = 0; i < waiters.size(); ++i)
+		waiters[i](event->result);
 }
 
-inline Worker::QueryFinishedHandlerType Accessor::Core::GetQueryFinishedHandler()
+/////////////////////////////////////////////////////////////////////////////
+struct Accessor::Core : public std::enable_shared_from_this<Accessor::Core>
 {
-	return std::bind(&Core::on_query_finished, shared_from_this(), _1);
-}
+	typedef std::vector<Worker::Ptr> Workders;
+
+	Workders workers_;
+	std::shared_ptr<Dispatcher> dispatcher_;
+	std::shared_ptr<Flights> flights_; // ConnectParams::singleFlight
+	std::shared_ptr<QueryStats> stats_; // ConnectParams::queryStats
+
+	// stub mode, no workers
+	QueryStub stub_;
+	Serial* serial_;
+
+	Core() : dispatcher_(new Dispatcher()), serial_(nullptr) {}
+};
 
 /////////////////////////////////////////////////////////////////////////////
 Accessor::Accessor()
@@ -620,11 +1823,17 @@ bool Accessor::Init(const ConnectParams& params)
 	bool ret = true;
 
 	mCore->workers_.resize(params.workerNum);
+	if (params.singleFlight)
+		mCore->flights_.reset(new Flights());
+	if (params.queryStats)
+	{
+		mCore->stats_.reset(new QueryStats());
+		mCore->stats_->slowQueryTime = int64(params.slowQueryTime) * 1000;
+	}
 	auto& serial = net::Scheduler::GetInstance().GetSerial();
-	auto& handler = mCore->GetQueryFinishedHandler();
 	for (size_t i = 0; i < mCore->workers_.size(); ++i)
 	{
-		Worker::Ptr worker(new Worker(this, handler, serial));
+		Worker::Ptr worker(new Worker(this, mCore->dispatcher_, mCore->stats_, serial));
 		if (!worker->start(params))
 			ret = false;
 
@@ -641,19 +1850,19 @@ bool Accessor::Init(const ConnectParams& params)
 
 		mCore->workers_.clear();
 	}
-	else
-	{
-		for (size_t i = 0; i < mCore->workers_.size(); ++i)
-		{
-			mCore->followers_queue_.push_back(mCore->workers_[i]);
-		}
-	}
 
 	return ret;
 }
 
+void Accessor::InitStub(Serial& serial, const QueryStub& stub)
+{
+	mCore->serial_ = &serial;
+	mCore->stub_ = stub;
+}
+
 void Accessor::Release()
 {
+	mCore->stub_ = nullptr;
 	for (size_t i = 0; i < mCore->workers_.size(); ++i)
 	{
 		mCore->workers_[i]->stop();
@@ -661,12 +1870,42 @@ void Accessor::Release()
 	}
 
 	mCore->workers_.clear();
-	mCore->query_queue_.clear();
+	while (QueryNode* node = mCore->dispatcher_->queue_.pop())
+		QueryPtr(node).reset();
 }
 
-void Accessor::PostQuery(const Query& _query)
+void Accessor::PostQuery(Query&& _query)
 {
-	QueryPtr query(new Query(_query));
+	std::shared_ptr<Flights> flights = mCore->stub_ ? nullptr : mCore->flights_;
+	if (flights && Flights::sharable(_query))
+	{
+		std::string key = Flights::key(_query);
+		std::unique_lock<std::mutex> lock(flights->mutex);
+		auto it = flights->queries.find(key);
+		if (it != flights->queries.end())
+		{
+			it->second->waiters.push_back(std::move(_query.handler));
+			return;
+		}
+
+		QueryPtr query = QueryPtr::make(std::move(_query));
+		query.get()->flights = flights;
+		flights->queries.emplace(std::move(key), query.get());
+		lock.unlock();
+
+		mCore->dispatcher_->post(query);
+		return;
+	}
+
+	QueryPtr query = QueryPtr::make(std::move(_query));
+	if (mCore->stub_)
+	{
+		auto core = mCore;
+		Serial::Priority priority = query->queryType == QueryType::BatchQuery ? Serial::Priority::Bulk : Serial::Priority::Normal;
+		core->serial_->Post([core, query]() { core->stub_(*query); }, Serial::PostTag::DBResult, priority);
+		return;
+	}
+
 	if (query->allThreadQuery)
 	{
 		for (size_t i = 0; i < mCore->workers_.size(); ++i)
@@ -684,14 +1923,8 @@ void Accessor::PostQuery(const Query& _query)
 
 		return;
 	}
-	else
-	{
-		{
-			std::lock_guard<std::mutex> guard(mCore->query_queue_mutex_);
-			mCore->query_queue_.push_back(query);
-		}
-		mCore->post_query_to_follower();
-	}
+
+	mCore->dispatcher_->post(query);
 }
 
 ulong Accessor::EscapeString(char *to, const char* from, unsigned long length)
@@ -721,3 +1954,43 @@ uint Accessor::GetWorkerThread()
 	}
 	return id;
 }
+
+std::vector<std::string> Accessor::GetQueryGroups()
+{
+	std::vector<std::string> groups;
+	if (mCore->stats_)
+	{
+		for (auto& it : mCore->stats_->groups)
+			groups.push_back(it.first);
+	}
+	return groups;
+}
+
+const utils::Histogram* Accessor::GetQueryHistogram(const std::string& group, QueryStage stage)
+{
+	if (!mCore->stats_) return nullptr;
+
+	auto it = mCore->stats_->groups.find(group);
+	if (it == mCore->stats_->groups.end())
+		return nullptr;
+	return &it->second->stages[(int)stage % QUERY_STAGE_COUNT];
+}
+
+void Accessor::ResetQueryStats()
+{
+	if (mCore->stats_)
+		mCore->stats_->groups.clear();
+}
+
+uint Accessor::GetQueueDepth()
+{
+	return (uint)mCore->dispatcher_->queue_.size();
+}
+
+std::vector<WorkerStats> Accessor::GetWorkerStats()
+{
+	std::vector<WorkerStats> stats;
+	for (size_t i = 0; i < mCore->workers_.size(); ++i)
+		stats.push_back(mCore->workers_[i]->get_stats());
+	return stats;
+}
@@ -2,9 +2,16 @@
 #define __DB_MYSQL_ASYNC_MGR_HEADER__
 
 #include <utils/typedef.h>
+#include <utils/function.h>
+#include <utils/system.h>
+#include <utils/histogram.h>
 #include <string>
 #include <functional>
 #include <memory>
+#include <vector>
+#include <string.h>
+
+class Serial;
 
 // TODO:
 // 1. Զ
@@ -13,6 +20,8 @@
 namespace mysql
 {
 	enum { DEFAULT_PREFETCH_ROWS = 10 };
+	enum { DEFAULT_STREAM_WINDOW = 4 };
+	enum { DEFAULT_COALESCE_MAX = 64 };
 
 #pragma pack(push,1)
 	// datetime type
@@ -20,12 +29,22 @@ namespace mysql
 	{
 		unsigned int  year, month, day, hour, minute, second;
 		unsigned long second_part;
-		unsigned int  reserve1, reserve2;
+		unsigned int  reserve1, reserve2; // reserve1: set for a negative TIME
 	};
 #pragma pack(pop)
 
+	// where the time of a query goes, each in microsec
+	enum class QueryStage
+	{
+		Queue,   // from PostQuery() until a worker takes it
+		Execute, // until the server's answer is in, streamed BatchQuery: until its rows start
+		Decode,  // rows copied into the result, streamed BatchQuery: its first chunk
+		Delay,   // from posting the result until its handler runs on the serial
+	};
+	enum { QUERY_STAGE_COUNT = 4 };
+
 	struct Result;
-	typedef std::function<void(Result)> ResultHandler;
+	typedef utils::Function<void(Result)> ResultHandler;
 
 	enum class QueryType
 	{
@@ -33,28 +52,134 @@ namespace mysql
 		Execute,
 		BatchQuery,
 		NormalQuery, // include type Query and Execute
+		Statement,   // prepared once per worker, ? placeholders are bound from Query::params
+	};
+
+	// type of a statement parameter or a result column
+	enum class ValueType
+	{
+		Null, // columns: not returned
+		Int8,
+		Int16,
+		Int32,
+		Int64,
+		Float,
+		Double,
+		String,
+		Blob,
+		Time,
+	};
+
+	// parameters of a prepared statement, bound in order to its ? placeholders.
+	// values are copied and sent in the binary protocol, nothing needs escaping
+	class Params
+	{
+	public:
+		struct Param
+		{
+			ValueType type;
+			bool      isUnsigned;
+			size_t    offset;
+			ulong     length;
+		};
+
+		Params& Add(int8 v)   { return Put(ValueType::Int8, false, &v, sizeof(v)); }
+		Params& Add(uint8 v)  { return Put(ValueType::Int8, true, &v, sizeof(v)); }
+		Params& Add(int16 v)  { return Put(ValueType::Int16, false, &v, sizeof(v)); }
+		Params& Add(uint16 v) { return Put(ValueType::Int16, true, &v, sizeof(v)); }
+		Params& Add(int32 v)  { return Put(ValueType::Int32, false, &v, sizeof(v)); }
+		Params& Add(uint32 v) { return Put(ValueType::Int32, true, &v, sizeof(v)); }
+		Params& Add(int64 v)  { return Put(ValueType::Int64, false, &v, sizeof(v)); }
+		Params& Add(uint64 v) { return Put(ValueType::Int64, true, &v, sizeof(v)); }
+		Params& Add(float v)  { return Put(ValueType::Float, false, &v, sizeof(v)); }
+		Params& Add(double v) { return Put(ValueType::Double, false, &v, sizeof(v)); }
+		Params& Add(const char* v) { return Put(ValueType::String, false, v, strlen(v)); }
+		Params& Add(const std::string& v) { return Put(ValueType::String, false, v.data(), v.length()); }
+		Params& Add(const Time& v) { return Put(ValueType::Time, false, &v, sizeof(v)); }
+		Params& AddBlob(const void* data, size_t length) { return Put(ValueType::Blob, false, data, length); }
+		Params& AddNull() { return Put(ValueType::Null, false, nullptr, 0); }
+
+		size_t Size() const { return mItems.size(); }
+		const Param& operator[](size_t index) const { return mItems[index]; }
+		const char* Data(const Param& param) const { return mData.empty() ? nullptr : &mData[param.offset]; }
+
+		void Clear()
+		{
+			mItems.clear();
+			mData.clear();
+		}
+
+	private:
+		// each value starts 8 byte aligned
+		Params& Put(ValueType type, bool isUnsigned, const void* value, size_t length)
+		{
+			Param param = { type, isUnsigned, (mData.size() + 7) & ~size_t(7), (ulong)length };
+			mData.resize(param.offset + length);
+			if (length != 0)
+				memcpy(&mData[param.offset], value, length);
+			mItems.push_back(param);
+			return *this;
+		}
+
+	private:
+		std::vector<Param> mItems;
+		std::vector<char>  mData;
+	};
+
+	enum class RowLayout
+	{
+		Fixed,   // every column padded to its declared width
+		Compact, // strings and blobs as a BytesRef into a packed area after the rows
+		Columnar, // one array per column plus a null bitmap, strings and blobs as in Compact
 	};
 
+	// a compact string or blob: bytes at Result::data + offset
+	struct BytesRef
+	{
+		uint32 offset;
+		uint32 length;
+	};
+
+	// a column of a select result
+	struct Column
+	{
+		ValueType type;
+		bool      isUnsigned;
+		uint32    offset; // in a row, columnar: of the column array in data
+		uint32    width;  // of one value, 0: not returned
+		uint32    nulls;  // columnar: of the null bitmap in data
+	};
+
+	// move-only, the handler is stored inline
 	struct Query
 	{
 		ResultHandler handler;
 		std::string   sql;
 		QueryType     queryType;
+		Params        params;          // QueryType::Statement
+		RowLayout     layout;          // of selected rows
 		int           prefetchRows;    // number of rows per one COM_FETCH
+		int           streamWindow;    // BatchQuery: chunks not yet handled by the serial before the worker waits, 0: no limit
 		unsigned int  bindThread;      // bind worker thread
 		bool          allThreadQuery; // ǷӶִе˲ѯ
+		const char*   tag;             // groups its timing, a string literal. nullptr: grouped by the sql with its values taken out
 
 		Query()
 		{
 			queryType      = QueryType::NormalQuery;
+			layout         = RowLayout::Fixed;
 			prefetchRows   = DEFAULT_PREFETCH_ROWS;
+			streamWindow   = DEFAULT_STREAM_WINDOW;
 			bindThread     = 0;
 			allThreadQuery = false;
+			tag            = nullptr;
 		}
 	};
 
 	struct Result
 	{
+		Result() { memset(this, 0, sizeof(Result)); }
+
 		int   ErrorCode()      { return error;        }
 		int   SelectRowCount() { return rowCount;     }
 		int   SelectRowSize()  { return rowSize;      }
@@ -64,6 +189,63 @@ namespace mysql
 		template<typename T>
 		T* CastSelctData() { return reinterpret_cast<T*>(data); }
 
+		// columns of a select, for either layout. only valid inside the handler, like data
+		int ColumnCount() { return columnCount; }
+		const Column& GetColumn(int column) { return columns[column]; }
+
+		// a fixed width value, T must match the column type (Time for dates and times)
+		template<typename T>
+		T Get(int row, int column)
+		{
+			T value;
+			memcpy(&value, Field(row, column), sizeof(T));
+			return value;
+		}
+
+		// a string or blob. a fixed layout string ends at its first zero byte
+		const char* GetBytes(int row, int column, size_t& length)
+		{
+			const Column& col = columns[column];
+			const char* field = Field(row, column);
+			if (layout != RowLayout::Fixed && (col.type == ValueType::String || col.type == ValueType::Blob))
+			{
+				BytesRef ref;
+				memcpy(&ref, field, sizeof(ref));
+				length = ref.length;
+				return static_cast<const char*>(data) + ref.offset;
+			}
+			length = col.type == ValueType::String ? strnlen(field, col.width) : col.width;
+			return field;
+		}
+
+		std::string GetString(int row, int column)
+		{
+			size_t length = 0;
+			const char* bytes = GetBytes(row, column, length);
+			return std::string(bytes, length);
+		}
+
+		const char* Field(int row, int column)
+		{
+			const Column& col = columns[column];
+			if (layout == RowLayout::Columnar)
+				return static_cast<const char*>(data) + col.offset + size_t(row) * col.width;
+			return static_cast<const char*>(data) + size_t(row) * rowSize + col.offset;
+		}
+
+		// columnar: the values of one column, 16 byte aligned. BytesRef for strings and blobs
+		template<typename T>
+		const T* ColumnData(int column) { return reinterpret_cast<const T*>(static_cast<const char*>(data) + columns[column].offset); }
+
+		// columnar: bit (row % 8) of byte (row / 8) is set for NULL
+		const uint8* NullBitmap(int column) { return static_cast<const uint8*>(data) + columns[column].nulls; }
+
+		// NULL is only kept by the columnar layout, the others read it as zero
+		bool IsNull(int row, int column)
+		{
+			return layout == RowLayout::Columnar && (NullBitmap(column)[row >> 3] & (1 << (row & 7))) != 0;
+		}
+
 		int error; // 0:no error
 		QueryType queryType;
 
@@ -74,8 +256,12 @@ namespace mysql
 		int   rowCount;
 		int   rowSize;
 		void* data;
+		size_t dataSize; // bytes at data, rows and packed strings
 		void* fields;
 		int   prefetchRows; // number of rows per one COM_FETCH
+		RowLayout     layout;
+		int           columnCount;
+		const Column* columns;
 	};
 
 	struct ConnectParams
@@ -86,8 +272,51 @@ namespace mysql
 		std::string  db;
 		int          port;
 		size_t       workerNum;
+		utils::CPUSet affinity; // cpus for the worker threads (named "db"), empty: left to the os
+
+		// Execute queries not bound to a worker share round trips: consecutive INSERT INTO
+		// the same table and columns are merged into one multi-row statement, others are sent as
+		// a multi-statement batch. each handler still gets its own result: a merged insert failed by
+		// a duplicate or foreign key runs again query by query, other errors go to all of its queries.
+		// after a lost connection nothing of the batch is sent again
+		bool         coalesce;
+		uint         coalesceWindow; // millisec a worker waits for more executes, 0: only the queued ones
+		uint         coalesceMax;    // queries per round trip
+
+		// a SELECT identical to one not answered yet (same sql and layout, not bound to a worker)
+		// waits for that one instead of being sent, all their handlers get the same result
+		bool         singleFlight;
+
+		// every query timed by QueryStage, see Accessor::GetQueryHistogram()
+		bool         queryStats;
+		uint         slowQueryTime;  // millisec from PostQuery() to the handler above which a query is logged without its values, 0: off
+
+		ConnectParams()
+		{
+			port           = 0;
+			workerNum      = 1;
+			coalesce       = false;
+			coalesceWindow = 1;
+			coalesceMax    = DEFAULT_COALESCE_MAX;
+			singleFlight   = false;
+			queryStats     = true;
+			slowQueryTime  = 0;
+		}
 	};
 
+	// a db worker thread right now, to size workerNum
+	struct WorkerStats
+	{
+		uint   queued;   // bound to this worker (bindThread, allThreadQuery) and not started
+		bool   busy;     // running a query
+		uint64 queries;  // taken from the queues since Init()
+		uint64 busyTime; // microsec spent running them
+	};
+
+	// answers a query in place of the database, called on the serial.
+	// it must call query.handler, the result data only has to live through that call
+	typedef std::function<void(Query& query)> QueryStub;
+
 	class Accessor
 	{
 	public:
@@ -95,8 +324,10 @@ namespace mysql
 		~Accessor();
 
 		bool Init(const ConnectParams& params);
+		// no database: every query is posted to the serial and answered by the stub, for simulations
+		void InitStub(Serial& serial, const QueryStub& stub);
 		void Release();
-		void PostQuery(const Query& query);
+		void PostQuery(Query&& query);
 
 		static ulong EscapeString(char *to, const char* from, unsigned long length);
 		static std::string EscapeString(const char* from, ulong len);
@@ -105,6 +336,21 @@ namespace mysql
 		// return: failed:0
 		uint GetWorkerThread();
 
+		// serial thread only. groups are query tags, or the sql with its values taken out
+		std::vector<std::string> GetQueryGroups();
+
+		// microsec, nullptr for a group not seen
+		const utils::Histogram* GetQueryHistogram(const std::string& group, QueryStage stage);
+
+		// forgets the groups, histograms got before are gone
+		void ResetQueryStats();
+
+		// any thread: queries waiting for whichever worker is free
+		uint GetQueueDepth();
+
+		// any thread, one per worker
+		std::vector<WorkerStats> GetWorkerStats();
+
 	private:
 		Accessor(const Accessor&) = delete;
 		Accessor& operator=(const Accessor&) = delete;
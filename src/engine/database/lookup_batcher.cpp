@@ -0,0 +1,188 @@
+#include "lookup_batcher.h"
+#include "sql_builder.h"
+#include <utils/serial.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace mysql;
+
+namespace
+{
+	// lookups of one template going out in the same query
+	struct Batch
+	{
+		std::vector<uint64> keys; // the IN() list, each key once
+		std::unordered_map<uint64, std::vector<LookupHandler>> handlers;
+	};
+
+	// signed keys come back the way Lookup() took them, converted to uint64
+	uint64 rowKey(Result& result, int row)
+	{
+		const Column& column = result.GetColumn(0);
+		switch (column.type)
+		{
+		case ValueType::Int8:
+			return column.isUnsigned ? (uint64)result.Get<uint8>(row, 0) : (uint64)(int64)result.Get<int8>(row, 0);
+		case ValueType::Int16:
+			return column.isUnsigned ? (uint64)result.Get<uint16>(row, 0) : (uint64)(int64)result.Get<int16>(row, 0);
+		case ValueType::Int32:
+			return column.isUnsigned ? (uint64)result.Get<uint32>(row, 0) : (uint64)(int64)result.Get<int32>(row, 0);
+		default:
+			return result.Get<uint64>(row, 0);
+		}
+	}
+
+	bool integerKey(Result& result)
+	{
+		ValueType type = result.GetColumn(0).type;
+		return type == ValueType::Int8 || type == ValueType::Int16 || type == ValueType::Int32 || type == ValueType::Int64;
+	}
+
+	void dispatch(std::vector<LookupHandler>& handlers, Result& result, int row, int count)
+	{
+		for (size_t i = 0; i < handlers.size(); ++i)
+			handlers[i](result, row, count);
+	}
+
+	// rows are ordered by key, so each key's rows are one run
+	void onResult(Batch& batch, Result& result)
+	{
+		// a key of another type is never matched
+		int rows = result.error == 0 && result.columnCount != 0 && integerKey(result) ? result.rowCount : 0;
+		for (int row = 0; row < rows;)
+		{
+			uint64 key = rowKey(result, row);
+			int count = 1;
+			while (row + count < rows && rowKey(result, row + count) == key)
+				++count;
+
+			auto it = batch.handlers.find(key);
+			if (it != batch.handlers.end())
+			{
+				dispatch(it->second, result, row, count);
+				batch.handlers.erase(it);
+			}
+			row += count;
+		}
+
+		// not found, or the query failed
+		for (auto& it : batch.handlers)
+			dispatch(it.second, result, 0, 0);
+		batch.handlers.clear();
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+struct LookupBatcher::Core : public std::enable_shared_from_this<LookupBatcher::Core>
+{
+	Accessor& accessor;
+	Serial& serial;
+	std::vector<LookupTemplate> templates;
+	std::vector<std::shared_ptr<Batch>> pending; // by template id
+	bool flushPosted;
+
+	Core(Accessor& accessor, Serial& serial)
+		: accessor(accessor)
+		, serial(serial)
+		, flushPosted(false)
+	{
+	}
+
+	void Send(uint id);
+
+	void Flush();
+};
+
+void LookupBatcher::Core::Send(uint id)
+{
+	std::shared_ptr<Batch> batch;
+	batch.swap(pending[id]);
+	if (batch == nullptr) return;
+
+	const LookupTemplate& lookup = templates[id];
+	SQLBuilder builder;
+	if (lookup.columns.empty())
+		builder.Select(lookup.key);
+	else
+		builder.Select(lookup.key, lookup.columns);
+	builder.From(lookup.table).Where(lookup.key);
+	if (lookup.signedKey)
+		builder.In(std::vector<int64>(batch->keys.begin(), batch->keys.end()));
+	else
+		builder.In(batch->keys);
+	builder.OrderBy(lookup.key);
+
+	Query query;
+	query.sql = builder.str();
+	query.queryType = QueryType::Query;
+	query.layout = lookup.layout;
+	query.handler = [batch](Result result)
+	{
+		onResult(*batch, result);
+	};
+	accessor.PostQuery(std::move(query));
+}
+
+void LookupBatcher::Core::Flush()
+{
+	flushPosted = false;
+	for (size_t i = 0; i < pending.size(); ++i)
+		Send((uint)i);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+LookupBatcher::LookupBatcher(Accessor& accessor, Serial& serial)
+	: mCore(new LookupBatcher::Core(accessor, serial))
+{
+}
+
+LookupBatcher::~LookupBatcher()
+{
+}
+
+uint LookupBatcher::AddTemplate(const LookupTemplate& lookup)
+{
+	mCore->templates.push_back(lookup);
+	if (mCore->templates.back().maxBatch == 0)
+		mCore->templates.back().maxBatch = 1;
+	mCore->pending.push_back(nullptr);
+	return (uint)mCore->templates.size() - 1;
+}
+
+void LookupBatcher::Lookup(uint id, uint64 key, LookupHandler handler)
+{
+	if (id >= mCore->templates.size()) return;
+
+	std::shared_ptr<Batch>& batch = mCore->pending[id];
+	if (batch == nullptr)
+		batch = std::make_shared<Batch>();
+
+	std::vector<LookupHandler>& handlers = batch->handlers[key];
+	if (handlers.empty())
+		batch->keys.push_back(key);
+	handlers.push_back(std::move(handler));
+
+	if (batch->keys.size() >= mCore->templates[id].maxBatch)
+	{
+		mCore->Send(id);
+		return;
+	}
+
+	// runs after the events already queued, which may add more lookups
+	if (!mCore->flushPosted)
+	{
+		mCore->flushPosted = true;
+		std::weak_ptr<Core> weak = mCore;
+		mCore->serial.Post([weak]()
+		{
+			auto core = weak.lock();
+			if (core != nullptr)
+				core->Flush();
+		});
+	}
+}
+
+void LookupBatcher::Flush()
+{
+	mCore->Flush();
+}
@@ -0,0 +1,62 @@
+#ifndef __DB_LOOKUP_BATCHER_HEADER__
+#define __DB_LOOKUP_BATCHER_HEADER__
+
+#include <database/accessor.h>
+#include <string>
+#include <memory>
+
+namespace mysql
+{
+	// rows of one key: [row, row + count) of result, count 0 if the key wasn't found or on error.
+	// the result is shared by the whole batch, only valid inside the handler
+	typedef utils::Function<void(Result& result, int row, int count)> LookupHandler;
+
+	// SELECT key, columns FROM table WHERE key IN (...) ORDER BY key
+	struct LookupTemplate
+	{
+		std::string table;
+		std::string key;       // integer key column, always column 0 of the rows
+		bool        signedKey; // the key column is signed, Lookup() takes the key as (uint64)int64
+		std::string columns;   // the rest of the select list
+		RowLayout   layout;
+		uint        maxBatch;  // keys per query
+
+		LookupTemplate()
+		{
+			signedKey = false;
+			layout    = RowLayout::Fixed;
+			maxBatch  = 500;
+		}
+	};
+
+	// gathers point lookups by integer key and sends one IN() query per template.
+	// lookups made while the serial handles one batch of events are sent together
+	// once it gets to the flush posted by the first of them.
+	// serial thread only
+	class LookupBatcher
+	{
+	public:
+		LookupBatcher(Accessor& accessor, Serial& serial);
+		~LookupBatcher();
+
+		// returns the template id
+		uint AddTemplate(const LookupTemplate& lookup);
+
+		// the same key twice in a batch is asked for once, both handlers get its rows.
+		// a negative key of a signedKey template is passed converted, (uint64)key
+		void Lookup(uint id, uint64 key, LookupHandler handler);
+
+		// sends the gathered lookups now
+		void Flush();
+
+	private:
+		LookupBatcher(const LookupBatcher&) = delete;
+		LookupBatcher& operator=(const LookupBatcher&) = delete;
+
+	private:
+		struct Core;
+		std::shared_ptr<Core> mCore;
+	};
+}
+
+#endif
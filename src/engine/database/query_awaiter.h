@@ -0,0 +1,57 @@
+#ifndef __DB_QUERY_AWAITER_HEADER__
+#define __DB_QUERY_AWAITER_HEADER__
+
+// needs C++20, see utils/task.h
+#include <utils/task.h>
+#include <database/accessor.h>
+
+namespace mysql
+{
+	// co_await mysql::Await(accessor, query) inside a utils::Task.
+	// resumes on the serial of net::Scheduler with the result.
+	// select data belongs to the accessor, it is only valid until the coroutine suspends again.
+	// batch and all thread queries report more than once and can't be awaited, they return error -1
+	class QueryAwaiter
+	{
+	public:
+		QueryAwaiter(Accessor& accessor, Query&& query)
+			: mAccessor(accessor)
+			, mQuery(std::move(query))
+		{
+			mResult = Result();
+		}
+
+		bool await_ready() const noexcept { return false; }
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			if (mQuery.queryType == QueryType::BatchQuery || mQuery.allThreadQuery)
+			{
+				mResult.error = -1;
+				return false;
+			}
+
+			mQuery.handler = [this, h](Result result)
+			{
+				mResult = result;
+				h.resume();
+			};
+			mAccessor.PostQuery(std::move(mQuery));
+			return true;
+		}
+
+		Result await_resume() { return mResult; }
+
+	private:
+		Accessor& mAccessor;
+		Query     mQuery;
+		Result    mResult;
+	};
+
+	inline QueryAwaiter Await(Accessor& accessor, Query&& query)
+	{
+		return QueryAwaiter(accessor, std::move(query));
+	}
+}
+
+#endif
@@ -0,0 +1,546 @@
+#include "result_cache.h"
+#include <utils/serial.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <ctype.h>
+
+using namespace mysql;
+
+namespace
+{
+	// a kept result, shared with the hits still waiting on the serial
+	struct Cached
+	{
+		Result              result;
+		std::vector<char>   data;
+		std::vector<Column> columns;
+	};
+
+	typedef std::shared_ptr<const Cached> CachedPtr;
+
+	struct Entry
+	{
+		std::string              key;
+		CachedPtr                cached;
+		std::vector<std::string> tables;
+		std::chrono::steady_clock::duration expires; // serial time, zero: never
+		size_t                   bytes;
+	};
+
+	// a select on its way to the database
+	struct Miss
+	{
+		ResultHandler            handler;
+		std::string              key;
+		std::vector<std::string> tables;
+		uint                     ttl;
+		uint64                   generation; // of the tables when posted
+		int                      results;
+		bool                     store;
+	};
+
+	// a write on the way, its table is invalidated again once done
+	struct Write
+	{
+		ResultHandler handler;
+		std::string   table; // empty: everything
+	};
+
+	struct Hit
+	{
+		ResultHandler handler;
+		CachedPtr     cached;
+	};
+
+	// bookkeeping counted with each entry
+	enum { ENTRY_OVERHEAD = 128 };
+
+	bool isWordChar(char c)
+	{
+		return isalnum((unsigned char)c) || c == '_' || c == '$';
+	}
+
+	// next token from sql[i]: a word or `identifier` in lower case with any db. prefix dropped,
+	// "'" for a string literal, or one punctuation character. empty at the end
+	std::string nextToken(const std::string& sql, size_t& i)
+	{
+		while (i < sql.size() && isspace((unsigned char)sql[i]))
+			++i;
+		if (i >= sql.size())
+			return std::string();
+
+		char c = sql[i];
+		if (c == '\'' || c == '"')
+		{
+			for (++i; i < sql.size() && sql[i] != c; ++i)
+			{
+				if (sql[i] == '\\') ++i;
+			}
+			++i;
+			return "'";
+		}
+		if (c != '`' && !isWordChar(c))
+		{
+			++i;
+			return std::string(1, c);
+		}
+
+		std::string token;
+		for (;;)
+		{
+			token.clear();
+			if (i < sql.size() && sql[i] == '`')
+			{
+				for (++i; i < sql.size() && sql[i] != '`'; ++i)
+					token += (char)tolower((unsigned char)sql[i]);
+				++i;
+			}
+			else
+			{
+				for (; i < sql.size() && isWordChar(sql[i]); ++i)
+					token += (char)tolower((unsigned char)sql[i]);
+			}
+
+			if (i >= sql.size() || sql[i] != '.')
+				return token;
+			++i;
+		}
+	}
+
+	std::string lower(const std::string& name)
+	{
+		std::string out(name);
+		for (size_t i = 0; i < out.size(); ++i)
+			out[i] = (char)tolower((unsigned char)out[i]);
+		return out;
+	}
+
+	bool isKeyword(const std::string& token, const char* const* words)
+	{
+		for (; *words != nullptr; ++words)
+		{
+			if (token == *words)
+				return true;
+		}
+		return false;
+	}
+
+	// tables named after FROM, JOIN and the commas of a FROM list
+	std::vector<std::string> selectTables(const std::string& sql)
+	{
+		static const char* const ENDS_FROM[] = { "where", "group", "order", "limit", "having", "union", "on", "using", "for", "lock", nullptr };
+		static const char* const JOINS[] = { "join", "straight_join", nullptr };
+
+		std::vector<std::string> tables;
+		bool inFrom = false;
+		bool expectTable = false;
+		size_t i = 0;
+		for (std::string token = nextToken(sql, i); !token.empty(); token = nextToken(sql, i))
+		{
+			if (token == "from")
+			{
+				inFrom = expectTable = true;
+			}
+			else if (isKeyword(token, JOINS))
+			{
+				expectTable = true;
+			}
+			else if (expectTable)
+			{
+				expectTable = false;
+				if (token != "(" && token != "'" && isWordChar(token[0]))
+					tables.push_back(token);
+			}
+			else if (inFrom && token == ",")
+			{
+				expectTable = true;
+			}
+			else if (token == ")" || isKeyword(token, ENDS_FROM))
+			{
+				inFrom = false;
+			}
+		}
+		return tables;
+	}
+
+	// the table an UPDATE, INSERT, REPLACE, DELETE or TRUNCATE changes, empty if not sure
+	std::string writeTable(const std::string& sql)
+	{
+		static const char* const MODIFIERS[] = { "low_priority", "delayed", "high_priority", "ignore", "quick", "into", "table", nullptr };
+
+		size_t i = 0;
+		std::string verb = nextToken(sql, i);
+		if (verb != "update" && verb != "insert" && verb != "replace" && verb != "delete" && verb != "truncate")
+			return std::string();
+
+		std::string token = nextToken(sql, i);
+		while (isKeyword(token, MODIFIERS))
+			token = nextToken(sql, i);
+		if (verb == "delete")
+		{
+			if (token != "from")
+				return std::string(); // multi-table delete
+			token = nextToken(sql, i);
+		}
+		if (token.empty() || !isWordChar(token[0]))
+			return std::string();
+
+		// more than one table
+		for (std::string next = nextToken(sql, i); !next.empty(); next = nextToken(sql, i))
+		{
+			if (next == "join" || (verb == "update" && next == ","))
+				return std::string();
+			if (next == "set" || next == "values" || next == "value" || next == "select" || next == "where" || next == "(")
+				break;
+		}
+		return token;
+	}
+
+	// runs of whitespace outside quotes become one space, no trailing ';'
+	std::string normalize(const std::string& sql)
+	{
+		std::string out;
+		out.reserve(sql.size());
+		char quote = 0;
+		for (size_t i = 0; i < sql.size(); ++i)
+		{
+			char c = sql[i];
+			if (quote != 0)
+			{
+				out += c;
+				if (c == '\\' && i + 1 < sql.size())
+					out += sql[++i];
+				else if (c == quote)
+					quote = 0;
+			}
+			else if (isspace((unsigned char)c))
+			{
+				if (!out.empty() && out.back() != ' ')
+					out += ' ';
+			}
+			else
+			{
+				if (c == '\'' || c == '"' || c == '`')
+					quote = c;
+				out += c;
+			}
+		}
+		while (!out.empty() && (out.back() == ' ' || out.back() == ';'))
+			out.pop_back();
+		return out;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+struct ResultCache::Core : public std::enable_shared_from_this<ResultCache::Core>
+{
+	typedef std::list<Entry> Entries;
+
+	Accessor& accessor;
+	Serial& serial;
+	CacheParams params;
+
+	Entries lru; // most recently used first
+	std::unordered_map<std::string, Entries::iterator> byKey;
+	std::unordered_map<std::string, std::unordered_set<Entry*>> byTable;
+
+	// a miss is only kept if no write happened while it was on the way
+	std::unordered_map<std::string, uint64> tableGeneration;
+	uint64 epoch; // InvalidateKey() and Clear()
+
+	CacheStats stats;
+
+	Core(Accessor& accessor, Serial& serial)
+		: accessor(accessor)
+		, serial(serial)
+		, epoch(0)
+	{
+		memset(&stats, 0, sizeof(stats));
+	}
+
+	uint64 Generation(const std::vector<std::string>& tables);
+
+	void Erase(Entries::iterator it);
+
+	void Store(Miss& miss, const Result& result);
+
+	void OnResult(Miss& miss, const Result& result);
+
+	void InvalidateTable(const std::string& table);
+
+	void Clear();
+};
+
+uint64 ResultCache::Core::Generation(const std::vector<std::string>& tables)
+{
+	// generations only grow, so an unchanged sum means no table changed
+	uint64 generation = epoch;
+	for (size_t i = 0; i < tables.size(); ++i)
+	{
+		auto it = tableGeneration.find(tables[i]);
+		if (it != tableGeneration.end())
+			generation += it->second;
+	}
+	return generation;
+}
+
+void ResultCache::Core::Erase(Entries::iterator it)
+{
+	for (size_t i = 0; i < it->tables.size(); ++i)
+	{
+		auto table = byTable.find(it->tables[i]);
+		if (table == byTable.end()) continue;
+
+		table->second.erase(&*it);
+		if (table->second.empty())
+			byTable.erase(table);
+	}
+	stats.bytes -= it->bytes;
+	--stats.entries;
+	byKey.erase(it->key);
+	lru.erase(it);
+}
+
+void ResultCache::Core::Store(Miss& miss, const Result& result)
+{
+	if (!miss.store || result.error != 0 || Generation(miss.tables) != miss.generation)
+		return;
+
+	size_t size = result.dataSize;
+	if (size == 0 && result.layout == RowLayout::Fixed)
+		size = size_t(result.rowCount) * size_t(result.rowSize);
+	if (result.data == nullptr)
+		size = 0;
+
+	size_t bytes = size + result.columnCount * sizeof(Column) + miss.key.size() + ENTRY_OVERHEAD;
+	if (bytes > params.memoryBudget)
+		return;
+
+	auto old = byKey.find(miss.key);
+	if (old != byKey.end())
+		Erase(old->second);
+
+	std::shared_ptr<Cached> cached = std::make_shared<Cached>();
+	cached->result = result;
+	cached->data.assign(static_cast<const char*>(result.data), static_cast<const char*>(result.data) + size);
+	if (result.columns != nullptr)
+		cached->columns.assign(result.columns, result.columns + result.columnCount);
+
+	Entry entry;
+	entry.key = miss.key;
+	entry.cached = cached;
+	entry.tables = miss.tables;
+	entry.expires = miss.ttl != 0 ? serial.Now() + std::chrono::milliseconds(miss.ttl) : std::chrono::steady_clock::duration::zero();
+	entry.bytes = bytes;
+	lru.push_front(std::move(entry));
+
+	Entries::iterator it = lru.begin();
+	byKey[it->key] = it;
+	for (size_t i = 0; i < it->tables.size(); ++i)
+		byTable[it->tables[i]].insert(&*it);
+	stats.bytes += bytes;
+	++stats.entries;
+
+	while (stats.bytes > params.memoryBudget)
+	{
+		Erase(--lru.end());
+		++stats.evictions;
+	}
+}
+
+void ResultCache::Core::OnResult(Miss& miss, const Result& result)
+{
+	if (++miss.results == 1)
+	{
+		Store(miss, result);
+		return;
+	}
+
+	// more than one result, the kept one isn't the whole answer
+	if (miss.results == 2)
+	{
+		auto it = byKey.find(miss.key);
+		if (it != byKey.end())
+			Erase(it->second);
+	}
+}
+
+void ResultCache::Core::InvalidateTable(const std::string& table)
+{
+	++tableGeneration[table];
+
+	auto it = byTable.find(table);
+	if (it == byTable.end()) return;
+
+	std::vector<std::string> keys;
+	for (Entry* entry : it->second)
+		keys.push_back(entry->key);
+	for (size_t i = 0; i < keys.size(); ++i)
+		Erase(byKey[keys[i]]);
+	stats.invalidations += keys.size();
+}
+
+void ResultCache::Core::Clear()
+{
+	++epoch;
+	stats.invalidations += lru.size();
+	lru.clear();
+	byKey.clear();
+	byTable.clear();
+	stats.entries = 0;
+	stats.bytes = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+ResultCache::ResultCache(Accessor& accessor, Serial& serial)
+	: mCore(new ResultCache::Core(accessor, serial))
+{
+}
+
+ResultCache::~ResultCache()
+{
+}
+
+void ResultCache::Init(const CacheParams& params)
+{
+	mCore->params = params;
+}
+
+void ResultCache::PostQuery(Query&& query, const CacheOptions& options)
+{
+	bool cacheable = query.queryType == QueryType::Query || query.queryType == QueryType::NormalQuery
+		|| (query.queryType == QueryType::Statement && !options.key.empty());
+	if (!cacheable || query.bindThread != 0 || query.allThreadQuery)
+	{
+		mCore->accessor.PostQuery(std::move(query));
+		return;
+	}
+
+	// the same select in another layout is another entry
+	std::string key = options.key.empty() ? normalize(query.sql) : options.key;
+	key += '\0';
+	key += char('0' + (int)query.layout);
+
+	auto it = mCore->byKey.find(key);
+	if (it != mCore->byKey.end())
+	{
+		Entry& entry = *it->second;
+		if (entry.expires != std::chrono::steady_clock::duration::zero() && entry.expires <= mCore->serial.Now())
+		{
+			mCore->Erase(it->second);
+			++mCore->stats.expirations;
+		}
+		else
+		{
+			mCore->lru.splice(mCore->lru.begin(), mCore->lru, it->second);
+			++mCore->stats.hits;
+			if (!query.handler) return;
+
+			std::shared_ptr<Hit> hit = std::make_shared<Hit>();
+			hit->handler = std::move(query.handler);
+			hit->cached = entry.cached;
+			mCore->serial.Post([hit]()
+			{
+				const Cached& cached = *hit->cached;
+				Result result = cached.result;
+				result.data = cached.data.empty() ? nullptr : const_cast<char*>(&cached.data[0]);
+				result.columns = cached.columns.empty() ? nullptr : &cached.columns[0];
+				hit->handler(result);
+			}, Serial::PostTag::DBResult);
+			return;
+		}
+	}
+	++mCore->stats.misses;
+
+	std::shared_ptr<Miss> miss = std::make_shared<Miss>();
+	miss->handler = std::move(query.handler);
+	miss->key = std::move(key);
+	if (options.tables.empty())
+		miss->tables = selectTables(query.sql);
+	for (size_t i = 0; i < options.tables.size(); ++i)
+		miss->tables.push_back(lower(options.tables[i]));
+	miss->ttl = options.ttl != 0 ? options.ttl : mCore->params.ttl;
+	miss->generation = mCore->Generation(miss->tables);
+	miss->results = 0;
+	// kept only if something can drop it again
+	miss->store = !miss->tables.empty() || !options.key.empty() || miss->ttl != 0;
+
+	std::weak_ptr<Core> weak = mCore;
+	query.handler = [weak, miss](Result result)
+	{
+		auto core = weak.lock();
+		if (core != nullptr)
+			core->OnResult(*miss, result);
+		if (miss->handler)
+			miss->handler(result);
+	};
+	mCore->accessor.PostQuery(std::move(query));
+}
+
+void ResultCache::PostWrite(Query&& query)
+{
+	std::shared_ptr<Write> write = std::make_shared<Write>();
+	write->handler = std::move(query.handler);
+	write->table = writeTable(query.sql);
+	if (write->table.empty())
+		mCore->Clear();
+	else
+		mCore->InvalidateTable(write->table);
+
+	// a select posted meanwhile may have run before the write on another worker
+	std::weak_ptr<Core> weak = mCore;
+	query.handler = [weak, write](Result result)
+	{
+		auto core = weak.lock();
+		if (core != nullptr)
+		{
+			if (write->table.empty())
+				core->Clear();
+			else
+				core->InvalidateTable(write->table);
+		}
+		if (write->handler)
+			write->handler(result);
+	};
+	mCore->accessor.PostQuery(std::move(query));
+}
+
+void ResultCache::InvalidateKey(const std::string& key)
+{
+	++mCore->epoch;
+
+	// any layout
+	for (int layout = 0; layout <= (int)RowLayout::Columnar; ++layout)
+	{
+		auto it = mCore->byKey.find(key + '\0' + char('0' + layout));
+		if (it == mCore->byKey.end()) continue;
+
+		mCore->Erase(it->second);
+		++mCore->stats.invalidations;
+	}
+}
+
+void ResultCache::InvalidateTable(const std::string& table)
+{
+	mCore->InvalidateTable(lower(table));
+}
+
+void ResultCache::Clear()
+{
+	mCore->Clear();
+}
+
+CacheStats ResultCache::GetStats()
+{
+	return mCore->stats;
+}
+
+void ResultCache::ResetStats()
+{
+	size_t entries = mCore->stats.entries;
+	size_t bytes = mCore->stats.bytes;
+	memset(&mCore->stats, 0, sizeof(mCore->stats));
+	mCore->stats.entries = entries;
+	mCore->stats.bytes = bytes;
+}
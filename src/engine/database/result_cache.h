@@ -0,0 +1,85 @@
+#ifndef __DB_RESULT_CACHE_HEADER__
+#define __DB_RESULT_CACHE_HEADER__
+
+#include <database/accessor.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace mysql
+{
+	struct CacheParams
+	{
+		size_t memoryBudget; // bytes of cached results, least recently used go first
+		uint   ttl;          // millisec an entry lives by default, 0: until invalidated or evicted
+
+		CacheParams()
+		{
+			memoryBudget = 64 * 1024 * 1024;
+			ttl          = 60 * 1000;
+		}
+	};
+
+	struct CacheOptions
+	{
+		std::string              key;    // empty: the sql with its whitespace collapsed
+		uint                     ttl;    // millisec, 0: CacheParams::ttl
+		std::vector<std::string> tables; // writes to these drop the entry, empty: taken from FROM and JOIN
+
+		CacheOptions() : ttl(0) {}
+	};
+
+	struct CacheStats
+	{
+		uint64 hits;
+		uint64 misses;
+		uint64 evictions;     // dropped for the memory budget
+		uint64 expirations;   // found past their ttl
+		uint64 invalidations; // dropped by a write, InvalidateKey() or InvalidateTable()
+		size_t entries;
+		size_t bytes;
+	};
+
+	// read-through cache of select results in front of an Accessor.
+	// a hit is posted to the serial with a copy of the first result, without a round trip.
+	// a miss goes to the database and its result is kept, unless a write to one of its tables
+	// happened meanwhile. only queries answered with one result are cached.
+	// serial thread only, the accessor's serial
+	class ResultCache
+	{
+	public:
+		ResultCache(Accessor& accessor, Serial& serial);
+		~ResultCache();
+
+		void Init(const CacheParams& params);
+
+		// a select, answered from the cache when possible. statements need options.key,
+		// it has to cover the parameters. batch, bound and all thread queries go straight through
+		void PostQuery(Query&& query, const CacheOptions& options = CacheOptions());
+
+		// a write: drops the entries reading the table it changes when posted and again when done,
+		// selects may run on other workers meanwhile. a statement whose table isn't recognized drops everything
+		void PostWrite(Query&& query);
+
+		void InvalidateKey(const std::string& key);
+
+		// for writes that don't go through PostWrite(), e.g. WriteBehind
+		void InvalidateTable(const std::string& table);
+
+		void Clear();
+
+		CacheStats GetStats();
+
+		void ResetStats();
+
+	private:
+		ResultCache(const ResultCache&) = delete;
+		ResultCache& operator=(const ResultCache&) = delete;
+
+	private:
+		struct Core;
+		std::shared_ptr<Core> mCore;
+	};
+}
+
+#endif
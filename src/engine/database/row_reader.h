@@ -0,0 +1,249 @@
+#ifndef __DB_ROW_READER_HEADER__
+#define __DB_ROW_READER_HEADER__
+
+#include <database/accessor.h>
+#include <utils/fixed_str.h>
+#include <string>
+#include <vector>
+#include <string.h>
+
+// lists the members of a row struct in select column order, for mysql::RowReader:
+//   struct PlayerRow
+//   {
+//       uint32              id;
+//       utils::FixedStr<32> name;
+//       mysql::Time         created;
+//       DB_ROW_FIELDS(id, name, created)
+//   };
+#define DB_ROW_FIELDS(...) \
+	template<typename Visitor> void VisitFields(Visitor& visitor) { visitor(__VA_ARGS__); }
+
+namespace mysql
+{
+	// how a member type is checked against a column and read from it.
+	// a member of any other type fails to compile
+	template<typename T> struct FieldType;
+
+	// integers and floats take a column of the same size, the sign is not checked
+	template<typename T, ValueType TYPE>
+	struct ScalarFieldType
+	{
+		static bool Accept(const Column& column)
+		{
+			return column.type == TYPE && column.width == sizeof(T);
+		}
+
+		static void Read(const char* field, size_t, const char*, bool, T& out)
+		{
+			memcpy(&out, field, sizeof(T));
+		}
+	};
+
+	template<> struct FieldType<bool>   : ScalarFieldType<bool,   ValueType::Int8>   {};
+	template<> struct FieldType<int8>   : ScalarFieldType<int8,   ValueType::Int8>   {};
+	template<> struct FieldType<uint8>  : ScalarFieldType<uint8,  ValueType::Int8>   {};
+	template<> struct FieldType<int16>  : ScalarFieldType<int16,  ValueType::Int16>  {};
+	template<> struct FieldType<uint16> : ScalarFieldType<uint16, ValueType::Int16>  {};
+	template<> struct FieldType<int32>  : ScalarFieldType<int32,  ValueType::Int32>  {};
+	template<> struct FieldType<uint32> : ScalarFieldType<uint32, ValueType::Int32>  {};
+	template<> struct FieldType<int64>  : ScalarFieldType<int64,  ValueType::Int64>  {};
+	template<> struct FieldType<uint64> : ScalarFieldType<uint64, ValueType::Int64>  {};
+	template<> struct FieldType<float>  : ScalarFieldType<float,  ValueType::Float>  {};
+	template<> struct FieldType<double> : ScalarFieldType<double, ValueType::Double> {};
+	template<> struct FieldType<Time>   : ScalarFieldType<Time,   ValueType::Time>   {};
+
+	// strings and blobs, packed (compact and columnar layouts) or zero padded (fixed layout)
+	struct BytesFieldType
+	{
+		static bool Accept(const Column& column)
+		{
+			return column.type == ValueType::String || column.type == ValueType::Blob;
+		}
+
+		static void Bytes(const char* field, size_t width, const char* data, bool packed, const char*& bytes, size_t& length)
+		{
+			if (packed)
+			{
+				BytesRef ref;
+				memcpy(&ref, field, sizeof(ref));
+				bytes = data + ref.offset;
+				length = ref.length;
+				return;
+			}
+			const void* end = memchr(field, 0, width);
+			bytes = field;
+			length = end != nullptr ? static_cast<const char*>(end) - field : width;
+		}
+	};
+
+	template<> struct FieldType<std::string> : BytesFieldType
+	{
+		static void Read(const char* field, size_t width, const char* data, bool packed, std::string& out)
+		{
+			const char* bytes = nullptr;
+			size_t length = 0;
+			Bytes(field, width, data, packed, bytes, length);
+			out.assign(bytes, length);
+		}
+	};
+
+	// cut to LENGTH - 1 bytes
+	template<unsigned int LENGTH> struct FieldType<utils::FixedStr<LENGTH>> : BytesFieldType
+	{
+		static void Read(const char* field, size_t width, const char* data, bool packed, utils::FixedStr<LENGTH>& out)
+		{
+			const char* bytes = nullptr;
+			size_t length = 0;
+			Bytes(field, width, data, packed, bytes, length);
+			if (length > LENGTH - 1)
+				length = LENGTH - 1;
+			memcpy(out.val, bytes, length);
+			out.val[length] = '\0';
+		}
+	};
+
+	// decodes rows of a select into T, a struct with DB_ROW_FIELDS.
+	// Bind() checks the columns against the members once, Read() then copies each
+	// member from a precomputed place, with no type switch. valid as long as the result data
+	template<typename T>
+	class RowReader
+	{
+	public:
+		RowReader() : mData(nullptr), mRows(0), mPacked(false) {}
+
+		// false on a column count or type mismatch, with the first mismatch in error
+		bool Bind(Result& result, std::string* error = nullptr)
+		{
+			mSlots.clear();
+			mData = static_cast<const char*>(result.data);
+			mRows = result.error == 0 ? result.rowCount : 0;
+			mPacked = result.layout != RowLayout::Fixed;
+
+			Binder binder(result, mSlots, error);
+			T probe;
+			probe.VisitFields(binder);
+			if (!binder.ok)
+			{
+				mRows = 0;
+				return false;
+			}
+			return true;
+		}
+
+		int Size() const { return mRows; }
+
+		void Read(int row, T& out) const
+		{
+			Decoder decoder(mData, &mSlots[0], size_t(row), mPacked);
+			out.VisitFields(decoder);
+		}
+
+		T Get(int row) const
+		{
+			T out;
+			Read(row, out);
+			return out;
+		}
+
+		void ReadAll(std::vector<T>& out) const
+		{
+			if (mRows == 0) return;
+			out.resize(out.size() + mRows);
+			T* rows = &out[out.size() - mRows];
+			for (int i = 0; i < mRows; ++i)
+				Read(i, rows[i]);
+		}
+
+	private:
+		// a member is at data + offset + row * stride
+		struct Slot
+		{
+			size_t offset;
+			size_t stride;
+			size_t width;
+		};
+
+		struct Binder
+		{
+			Result& result;
+			std::vector<Slot>& slots;
+			std::string* error;
+			bool ok;
+
+			Binder(Result& result, std::vector<Slot>& slots, std::string* error)
+				: result(result), slots(slots), error(error), ok(true) {}
+
+			template<typename... F>
+			void operator()(F&... fields)
+			{
+				if (result.columnCount != int(sizeof...(fields)))
+				{
+					Fail("column count " + std::to_string(result.columnCount) + ", struct has " + std::to_string(sizeof...(fields)));
+					return;
+				}
+				int index = 0;
+				int expand[] = { 0, (Check(fields, index++), 0)... };
+				(void)expand;
+			}
+
+			template<typename F>
+			void Check(F&, int index)
+			{
+				if (!ok) return;
+
+				const Column& column = result.GetColumn(index);
+				if (!FieldType<F>::Accept(column))
+				{
+					Fail("column " + std::to_string(index) + " doesn't match its member");
+					return;
+				}
+
+				Slot slot;
+				slot.width = column.width;
+				slot.offset = column.offset;
+				slot.stride = result.layout == RowLayout::Columnar ? column.width : size_t(result.rowSize);
+				slots.push_back(slot);
+			}
+
+			void Fail(const std::string& message)
+			{
+				ok = false;
+				if (error != nullptr)
+					*error = message;
+			}
+		};
+
+		struct Decoder
+		{
+			const char* data;
+			const Slot* slot;
+			size_t row;
+			bool packed;
+
+			Decoder(const char* data, const Slot* slot, size_t row, bool packed)
+				: data(data), slot(slot), row(row), packed(packed) {}
+
+			template<typename... F>
+			void operator()(F&... fields)
+			{
+				int expand[] = { 0, (Decode(fields), 0)... };
+				(void)expand;
+			}
+
+			template<typename F>
+			void Decode(F& field)
+			{
+				const Slot& s = *slot++;
+				FieldType<F>::Read(data + s.offset + row * s.stride, s.width, data, packed, field);
+			}
+		};
+
+	private:
+		const char* mData;
+		int mRows;
+		bool mPacked;
+		std::vector<Slot> mSlots;
+	};
+}
+
+#endif
@@ -1,8 +1,10 @@
 #ifndef __DATABASE_SQL_BUILDER_HEADER__
 #define __DATABASE_SQL_BUILDER_HEADER__
 
+#include <database/accessor.h>
 #include <string>
 #include <sstream>
+#include <vector>
 #include <type_traits>
 
 namespace mysql
@@ -41,6 +43,8 @@ namespace mysql
 		SQLBuilder& PutVal(const unsigned short& v) { ss << v; return *this; }
 		SQLBuilder& PutVal(const signed int& v) { ss << v; return *this; }
 		SQLBuilder& PutVal(const unsigned int& v) { ss << v; return *this; }
+		SQLBuilder& PutVal(const signed long& v) { ss << v; return *this; }
+		SQLBuilder& PutVal(const unsigned long& v) { ss << v; return *this; }
 		SQLBuilder& PutVal(const signed long long& v) { ss << v; return *this; }
 		SQLBuilder& PutVal(const unsigned long long& v) { ss << v; return *this; }
 		SQLBuilder& PutVal(const float& v) { ss << v; return *this; }
@@ -52,7 +56,7 @@ namespace mysql
 		{
 			static_assert(std::alignment_of<T>::value == 1, "align != 1");
 			std::vector<char> buf(sizeof(v) * 2 + 1);
-			int len = (int)db_accessor::EscapeString(&buf[0], (char*)&v, sizeof(v));
+			int len = (int)Accessor::EscapeString(&buf[0], (char*)&v, sizeof(v));
 			ss << "'" << std::string(&buf[0], len) << "'";
 			return *this;
 		}
@@ -61,7 +65,7 @@ namespace mysql
 		SQLBuilder& AppendSelectFields(const T0& t0, T... t)
 		{
 			ss << "," << t0;
-			return InsertReplaceFields(t...);
+			return AppendSelectFields(t...);
 		}
 
 		SQLBuilder& AppendSelectFields()
@@ -303,11 +307,13 @@ namespace mysql
 		SQLBuilder& Limit(int l1)
 		{
 			ss << " LIMIT " << l1;
+			return *this;
 		}
 
 		SQLBuilder& Limit(int l1, int l2)
 		{
 			ss << " LIMIT " << l1 << "," << l2;
+			return *this;
 		}
 
 		template<typename T> SQLBuilder& Equal(const T& v) { ss << "="; PutVal(v); return *this; }
@@ -0,0 +1,438 @@
+#include "write_behind.h"
+#include <utils/serial.h>
+#include <utils/logger.h>
+#include <unordered_map>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace mysql;
+
+namespace
+{
+	struct Record
+	{
+		std::vector<std::string> values; // sql literals, valid where dirty or sending
+		uint64 dirty;   // columns changed since the last flush
+		uint64 sending; // columns of the UPDATE in flight
+		bool   leaving; // unregistered, dropped once written
+
+		Record() : dirty(0), sending(0), leaving(false) {}
+	};
+
+	struct Table
+	{
+		RecordSchema schema;
+		std::unordered_map<uint64, Record> records;
+	};
+}
+
+/////////////////////////////////////////////////////////////////////////////
+struct WriteBehind::Core : public std::enable_shared_from_this<WriteBehind::Core>
+{
+	Accessor& accessor;
+	Serial& serial;
+	std::vector<Table> tables;
+	WriteBehindParams params;
+	uint flushTimer;
+	uint syncTimer;
+	FILE* journal;
+	size_t pending; // records with dirty or sending columns
+
+	Core(Accessor& accessor, Serial& serial)
+		: accessor(accessor)
+		, serial(serial)
+		, flushTimer(0)
+		, syncTimer(0)
+		, journal(nullptr)
+		, pending(0)
+	{
+	}
+
+	~Core()
+	{
+		if (journal != nullptr)
+			fclose(journal);
+	}
+
+	Record* Find(uint schema, uint64 key);
+
+	Record& Register(uint schema, uint64 key);
+
+	bool Change(uint schema, uint64 key, uint column, std::string literal);
+
+	void Flush(uint schema, uint64 key, Record& record);
+
+	void FlushAll();
+
+	void OnWritten(uint schema, uint64 key, int error);
+
+	// journal lines are "table\tkey\tcolumn\tliteral\n", literals are escaped and have no line breaks
+	void Log(const Table& table, uint64 key, uint column, const std::string& literal);
+
+	void Replay(const std::string& path);
+
+	// rewrites the journal with only the columns not confirmed yet
+	void Compact();
+};
+
+Record* WriteBehind::Core::Find(uint schema, uint64 key)
+{
+	if (schema >= tables.size()) return nullptr;
+
+	auto it = tables[schema].records.find(key);
+	return it != tables[schema].records.end() ? &it->second : nullptr;
+}
+
+Record& WriteBehind::Core::Register(uint schema, uint64 key)
+{
+	Record& record = tables[schema].records[key];
+	record.values.resize(tables[schema].schema.columns.size());
+	record.leaving = false;
+	return record;
+}
+
+bool WriteBehind::Core::Change(uint schema, uint64 key, uint column, std::string literal)
+{
+	Record* record = Find(schema, key);
+	if (record == nullptr || column >= record->values.size())
+		return false;
+
+	if ((record->dirty | record->sending) == 0)
+		++pending;
+	record->values[column] = std::move(literal);
+	record->dirty |= uint64(1) << column;
+
+	if (journal != nullptr)
+		Log(tables[schema], key, column, record->values[column]);
+	return true;
+}
+
+void WriteBehind::Core::Flush(uint schema, uint64 key, Record& record)
+{
+	if (record.dirty == 0 || record.sending != 0)
+		return;
+
+	const RecordSchema& table = tables[schema].schema;
+	std::string sql = "UPDATE `" + table.table + "` SET ";
+	bool first = true;
+	for (size_t i = 0; i < table.columns.size(); ++i)
+	{
+		if ((record.dirty & (uint64(1) << i)) == 0) continue;
+
+		if (!first)
+			sql += ", ";
+		first = false;
+		sql += '`';
+		sql += table.columns[i];
+		sql += "`=";
+		sql += record.values[i];
+	}
+	sql += " WHERE `" + table.key + "`=" + std::to_string(key);
+
+	record.sending = record.dirty;
+	record.dirty = 0;
+
+	Query query;
+	query.sql = std::move(sql);
+	query.queryType = QueryType::Execute;
+	std::weak_ptr<Core> weak = shared_from_this();
+	query.handler = [weak, schema, key](Result result)
+	{
+		auto core = weak.lock();
+		if (core != nullptr)
+			core->OnWritten(schema, key, result.error);
+	};
+	accessor.PostQuery(std::move(query));
+}
+
+void WriteBehind::Core::FlushAll()
+{
+	for (size_t i = 0; i < tables.size(); ++i)
+	{
+		for (auto& it : tables[i].records)
+			Flush((uint)i, it.first, it.second);
+	}
+
+	if (journal != nullptr)
+		Compact();
+}
+
+void WriteBehind::Core::OnWritten(uint schema, uint64 key, int error)
+{
+	Record* record = Find(schema, key);
+	if (record == nullptr) return;
+
+	if (error != 0)
+	{
+		LOG_WARN(nullptr, "write behind: update of " << tables[schema].schema.table << " " << key << " failed, error " << error);
+		record->dirty |= record->sending;
+	}
+	record->sending = 0;
+
+	if (record->dirty == 0)
+	{
+		--pending;
+		if (record->leaving)
+			tables[schema].records.erase(key);
+	}
+	else if (record->leaving && error == 0)
+	{
+		// changed again while its last UPDATE was on the way
+		Flush(schema, key, *record);
+	}
+}
+
+void WriteBehind::Core::Log(const Table& table, uint64 key, uint column, const std::string& literal)
+{
+	fprintf(journal, "%s\t%llu\t%s\t", table.schema.table.c_str(), (unsigned long long)key, table.schema.columns[column].c_str());
+	fwrite(literal.data(), 1, literal.size(), journal);
+	fputc('\n', journal);
+	if (params.journalSync == 0)
+		fflush(journal);
+}
+
+void WriteBehind::Core::Replay(const std::string& path)
+{
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in) return;
+
+	size_t count = 0;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		size_t tab1 = line.find('\t');
+		size_t tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+		size_t tab3 = tab2 == std::string::npos ? tab2 : line.find('\t', tab2 + 1);
+		if (tab3 == std::string::npos) continue; // torn last line
+
+		uint schema = 0;
+		while (schema < tables.size() && line.compare(0, tab1, tables[schema].schema.table) != 0)
+			++schema;
+		if (schema == tables.size()) continue;
+
+		const std::vector<std::string>& columns = tables[schema].schema.columns;
+		std::string name = line.substr(tab2 + 1, tab3 - tab2 - 1);
+		uint column = 0;
+		while (column < columns.size() && columns[column] != name)
+			++column;
+		if (column == columns.size()) continue;
+
+		uint64 key = strtoull(line.c_str() + tab1 + 1, nullptr, 10);
+		if (Find(schema, key) == nullptr)
+		{
+			// not logged in any more, dropped once written
+			Register(schema, key).leaving = true;
+		}
+		Change(schema, key, column, line.substr(tab3 + 1));
+		++count;
+	}
+
+	if (count != 0)
+		LOG_INFO(nullptr, "write behind: replayed " << count << " changes from " << path);
+}
+
+void WriteBehind::Core::Compact()
+{
+	std::string path = params.journal;
+	std::string temp = path + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (file == nullptr)
+	{
+		LOG_WARN(nullptr, "write behind: can't write " << temp);
+		fflush(journal);
+		return;
+	}
+
+	FILE* current = journal;
+	journal = file;
+	for (size_t i = 0; i < tables.size(); ++i)
+	{
+		for (auto& it : tables[i].records)
+		{
+			uint64 unsaved = it.second.dirty | it.second.sending;
+			for (uint column = 0; unsaved != 0; ++column, unsaved >>= 1)
+			{
+				if (unsaved & 1)
+					Log(tables[i], it.first, column, it.second.values[column]);
+			}
+		}
+	}
+	fclose(file);
+	fclose(current);
+
+	// Init() takes the .tmp file if this stops between the two
+	remove(path.c_str());
+	rename(temp.c_str(), path.c_str());
+
+	journal = fopen(path.c_str(), "ab");
+	if (journal == nullptr)
+		LOG_WARN(nullptr, "write behind: can't reopen " << path << ", journal off");
+}
+
+/////////////////////////////////////////////////////////////////////////////
+WriteBehind::WriteBehind(Accessor& accessor, Serial& serial)
+	: mCore(new WriteBehind::Core(accessor, serial))
+{
+}
+
+WriteBehind::~WriteBehind()
+{
+}
+
+uint WriteBehind::AddSchema(const RecordSchema& schema)
+{
+	Table table;
+	table.schema = schema;
+	if (table.schema.columns.size() > 64)
+		table.schema.columns.resize(64);
+	mCore->tables.push_back(std::move(table));
+	return (uint)mCore->tables.size() - 1;
+}
+
+bool WriteBehind::Init(const WriteBehindParams& params)
+{
+	mCore->params = params;
+
+	if (!params.journal.empty())
+	{
+		std::string temp = params.journal + ".tmp";
+		if (FILE* file = fopen(params.journal.c_str(), "rb"))
+		{
+			fclose(file);
+			mCore->Replay(params.journal);
+		}
+		else
+		{
+			mCore->Replay(temp);
+		}
+
+		mCore->journal = fopen(params.journal.c_str(), "ab");
+		if (mCore->journal == nullptr)
+			return false;
+
+		// the replayed changes go out now, and the journal starts over with them
+		mCore->FlushAll();
+		remove(temp.c_str());
+	}
+
+	std::weak_ptr<Core> weak = mCore;
+	if (params.flushInterval != 0)
+	{
+		mCore->flushTimer = mCore->serial.AddTimer(params.flushInterval, [weak](uint)
+		{
+			auto core = weak.lock();
+			if (core != nullptr)
+				core->FlushAll();
+		});
+	}
+
+	if (mCore->journal != nullptr && params.journalSync != 0)
+	{
+		mCore->syncTimer = mCore->serial.AddTimer(params.journalSync, [weak](uint)
+		{
+			auto core = weak.lock();
+			if (core != nullptr && core->journal != nullptr)
+				fflush(core->journal);
+		});
+	}
+
+	return true;
+}
+
+void WriteBehind::Release()
+{
+	if (mCore->flushTimer != 0)
+	{
+		mCore->serial.RemoveTimer(mCore->flushTimer);
+		mCore->flushTimer = 0;
+	}
+	if (mCore->syncTimer != 0)
+	{
+		mCore->serial.RemoveTimer(mCore->syncTimer);
+		mCore->syncTimer = 0;
+	}
+
+	mCore->FlushAll();
+
+	if (mCore->journal != nullptr)
+	{
+		fclose(mCore->journal);
+		mCore->journal = nullptr;
+	}
+}
+
+void WriteBehind::Register(uint schema, uint64 key)
+{
+	if (schema < mCore->tables.size())
+		mCore->Register(schema, key);
+}
+
+void WriteBehind::Unregister(uint schema, uint64 key)
+{
+	Record* record = mCore->Find(schema, key);
+	if (record == nullptr) return;
+
+	if ((record->dirty | record->sending) == 0)
+	{
+		mCore->tables[schema].records.erase(key);
+		return;
+	}
+	record->leaving = true;
+	mCore->Flush(schema, key, *record);
+}
+
+bool WriteBehind::IsRegistered(uint schema, uint64 key)
+{
+	Record* record = mCore->Find(schema, key);
+	return record != nullptr && !record->leaving;
+}
+
+bool WriteBehind::Set(uint schema, uint64 key, uint column, int64 value)
+{
+	return mCore->Change(schema, key, column, std::to_string(value));
+}
+
+bool WriteBehind::Set(uint schema, uint64 key, uint column, uint64 value)
+{
+	return mCore->Change(schema, key, column, std::to_string(value));
+}
+
+bool WriteBehind::Set(uint schema, uint64 key, uint column, double value)
+{
+	char buff[32];
+	snprintf(buff, sizeof(buff), "%.17g", value);
+	return mCore->Change(schema, key, column, buff);
+}
+
+bool WriteBehind::Set(uint schema, uint64 key, uint column, const std::string& value)
+{
+	return SetBlob(schema, key, column, value.data(), value.size());
+}
+
+bool WriteBehind::SetBlob(uint schema, uint64 key, uint column, const void* data, size_t length)
+{
+	return mCore->Change(schema, key, column, "'" + Accessor::EscapeString(static_cast<const char*>(data), (ulong)length) + "'");
+}
+
+bool WriteBehind::SetNull(uint schema, uint64 key, uint column)
+{
+	return mCore->Change(schema, key, column, "NULL");
+}
+
+void WriteBehind::Flush(uint schema, uint64 key)
+{
+	Record* record = mCore->Find(schema, key);
+	if (record != nullptr)
+		mCore->Flush(schema, key, *record);
+}
+
+void WriteBehind::FlushAll()
+{
+	mCore->FlushAll();
+}
+
+size_t WriteBehind::GetPendingCount()
+{
+	return mCore->pending;
+}
@@ -0,0 +1,90 @@
+#ifndef __DB_WRITE_BEHIND_HEADER__
+#define __DB_WRITE_BEHIND_HEADER__
+
+#include <database/accessor.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace mysql
+{
+	// a table kept by WriteBehind, its rows are found by one integer key column
+	struct RecordSchema
+	{
+		std::string              table;
+		std::string              key;     // key column
+		std::vector<std::string> columns; // at most 64
+	};
+
+	struct WriteBehindParams
+	{
+		uint        flushInterval; // millisec between flushes of all dirty records, 0: only Flush() and FlushAll()
+		std::string journal;       // file of changes not written yet, replayed by Init(). empty: no journal
+		uint        journalSync;   // millisec between handing the journal to the os, 0: on every change
+
+		WriteBehindParams()
+		{
+			flushInterval = 5000;
+			journalSync   = 100;
+		}
+	};
+
+	// write-behind cache over an Accessor: changes to registered records are kept with a dirty bit
+	// per column, and each flush sends one UPDATE per record with the latest value of the dirty columns.
+	// a record has at most one UPDATE in flight, so they reach the database in order.
+	// a failed UPDATE leaves its columns dirty for the next flush.
+	// serial thread only, results come back on the serial given to the constructor
+	class WriteBehind
+	{
+	public:
+		WriteBehind(Accessor& accessor, Serial& serial);
+		~WriteBehind();
+
+		// before Init(), returns the schema id
+		uint AddSchema(const RecordSchema& schema);
+
+		// replays the journal and starts the flush timer. false if the journal can't be opened
+		bool Init(const WriteBehindParams& params);
+
+		// flushes everything and stops the timers. keep the serial running until
+		// GetPendingCount() is 0, what is still pending stays in the journal
+		void Release();
+
+		// a record already stored in the table, e.g. on login
+		void Register(uint schema, uint64 key);
+
+		// on logout: flushes the record and forgets it once written
+		void Unregister(uint schema, uint64 key);
+
+		bool IsRegistered(uint schema, uint64 key);
+
+		// false if the record isn't registered
+		bool Set(uint schema, uint64 key, uint column, int64 value);
+		bool Set(uint schema, uint64 key, uint column, uint64 value);
+		bool Set(uint schema, uint64 key, uint column, int32 value) { return Set(schema, key, column, int64(value)); }
+		bool Set(uint schema, uint64 key, uint column, uint32 value) { return Set(schema, key, column, uint64(value)); }
+		bool Set(uint schema, uint64 key, uint column, double value);
+		bool Set(uint schema, uint64 key, uint column, const std::string& value);
+		bool Set(uint schema, uint64 key, uint column, const char* value) { return Set(schema, key, column, std::string(value)); }
+		bool SetBlob(uint schema, uint64 key, uint column, const void* data, size_t length);
+		bool SetNull(uint schema, uint64 key, uint column);
+
+		// writes the dirty columns of one record now
+		void Flush(uint schema, uint64 key);
+
+		void FlushAll();
+
+		// records with changes the database hasn't confirmed yet
+		size_t GetPendingCount();
+
+	private:
+		WriteBehind(const WriteBehind&) = delete;
+		WriteBehind& operator=(const WriteBehind&) = delete;
+
+	private:
+		struct Core;
+		std::shared_ptr<Core> mCore;
+	};
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __NET_INTERNAL_PACKET_POOL_HEADER__
+#define __NET_INTERNAL_PACKET_POOL_HEADER__
+
+#include <utils/node_pool.h>
+#include <stddef.h>
+
+namespace net
+{
+	// buffers of received packets on their way to the serial.
+	// allocated on io threads, freed on the serial thread
+	enum
+	{
+		SMALL_PACKET_SIZE = 256,
+		LARGE_PACKET_SIZE = 4096,
+	};
+
+	template<size_t Size>
+	union PacketBlock
+	{
+		PacketBlock* poolNext;
+		char data[Size];
+
+		PacketBlock() : poolNext(nullptr) {}
+	};
+
+	typedef PacketBlock<SMALL_PACKET_SIZE> SmallPacket;
+	typedef PacketBlock<LARGE_PACKET_SIZE> LargePacket;
+
+	inline char* AllocPacket(size_t len)
+	{
+		if (len <= SMALL_PACKET_SIZE)
+			return utils::NodePool<SmallPacket>::Alloc()->data;
+		if (len <= LARGE_PACKET_SIZE)
+			return utils::NodePool<LargePacket>::Alloc()->data;
+		return new char[len];
+	}
+
+	inline void FreePacket(char* buf, size_t len)
+	{
+		if (len <= SMALL_PACKET_SIZE)
+			utils::NodePool<SmallPacket>::Free(reinterpret_cast<SmallPacket*>(buf));
+		else if (len <= LARGE_PACKET_SIZE)
+			utils::NodePool<LargePacket>::Free(reinterpret_cast<LargePacket*>(buf));
+		else
+			delete[] buf;
+	}
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "internal-header.h"
 #include <utils/serial.h>
+#include <utils/task_pool.h>
 #include <memory>
 #include <mutex>
 #include <thread>
@@ -21,8 +22,12 @@ namespace net
 
 		std::mutex mutex;
 		std::vector<std::thread> threads;
+		utils::CPUSet affinity;
 
-		Core() : working(false), threads(1) {}
+		utils::TaskPool taskPool;
+		uint taskThreadNum;
+
+		Core() : working(false), threads(1), taskThreadNum(0) {}
 	};
 }
 
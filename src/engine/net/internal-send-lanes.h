@@ -0,0 +1,108 @@
+#ifndef __NET_INTERNAL_SEND_LANES_HEADER__
+#define __NET_INTERNAL_SEND_LANES_HEADER__
+
+#include "send_priority.h"
+#include <utils/typedef.h>
+#include <deque>
+#include <vector>
+#include <string.h>
+
+namespace net
+{
+	enum { DEFAULT_SEND_STARVATION_LIMIT = 8 };
+
+	// per connection send queues, not thread safe
+	class SendLanes
+	{
+	public:
+		typedef std::vector<byte> Frame;
+
+		enum { LANE_COUNT = (int)SendPriority::Count };
+
+		SendLanes()
+			: mStarvationLimit(DEFAULT_SEND_STARVATION_LIMIT)
+			, mQueuedBytes(0)
+		{
+			memset(mSkipped, 0, sizeof(mSkipped));
+		}
+
+		// a waiting lane is served after being passed over this many frames, 0: strict priority
+		void SetStarvationLimit(uint val) { mStarvationLimit = val; }
+
+		// |--length(2)--|--label(2)--|--body(length)--|
+		void Push(SendPriority priority, const void* data, size_t len)
+		{
+			int lane = (int)priority;
+			if (lane < 0 || lane >= LANE_COUNT)
+				lane = (int)SendPriority::Normal;
+
+			mLanes[lane].push_back(Frame(4 + len));
+			Frame& frame = mLanes[lane].back();
+			frame[0] = byte(len);
+			frame[1] = byte(len >> 8);
+			frame[2] = 24;
+			frame[3] = 0;
+			if (len != 0)
+				memcpy(&frame[4], data, len);
+
+			mQueuedBytes += frame.size();
+		}
+
+		bool Pop(Frame& out)
+		{
+			int lane = -1;
+			for (int i = 0; i < LANE_COUNT; ++i)
+			{
+				if (mLanes[i].empty()) continue;
+
+				if (lane < 0)
+					lane = i;
+				else if (mStarvationLimit != 0 && mSkipped[i] >= mStarvationLimit)
+				{
+					lane = i;
+					break;
+				}
+			}
+			if (lane < 0) return false;
+
+			for (int i = 0; i < LANE_COUNT; ++i)
+			{
+				if (i != lane && !mLanes[i].empty())
+					++mSkipped[i];
+			}
+			mSkipped[lane] = 0;
+
+			out.swap(mLanes[lane].front());
+			mLanes[lane].pop_front();
+			mQueuedBytes -= out.size();
+			return true;
+		}
+
+		void Clear()
+		{
+			for (int i = 0; i < LANE_COUNT; ++i)
+			{
+				mLanes[i].clear();
+				mSkipped[i] = 0;
+			}
+			mQueuedBytes = 0;
+		}
+
+		size_t GetDepth(SendPriority priority) const
+		{
+			int lane = (int)priority;
+			if (lane < 0 || lane >= LANE_COUNT) return 0;
+			return mLanes[lane].size();
+		}
+
+		size_t GetQueuedBytes() const { return mQueuedBytes; }
+
+	private:
+		std::deque<Frame> mLanes[LANE_COUNT];
+		uint              mSkipped[LANE_COUNT];
+		uint              mStarvationLimit;
+		size_t            mQueuedBytes;
+	};
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __NET_REPLY_TABLE_HEADER__
+#define __NET_REPLY_TABLE_HEADER__
+
+// needs C++20, see utils/task.h
+#include <utils/task.h>
+#include <optional>
+#include <unordered_map>
+
+namespace net
+{
+	// matches replies from other servers to the coroutines waiting for them.
+	// waiters live on `serial`, Complete may be called from any thread (e.g. OnRecvHandler).
+	// the table must outlive the serial's pending handlers.
+	//
+	// usage:
+	//   auto reply = co_await replies.Wait(requestID, 3000); // empty on timeout
+	//   replies.Complete(requestID, std::move(reply));
+	template<typename Key, typename T>
+	class ReplyTable
+	{
+	public:
+		explicit ReplyTable(Serial& serial) : mSerial(serial) {}
+
+		class Awaiter
+		{
+		public:
+			Awaiter(ReplyTable& table, const Key& key, uint timeout)
+				: mTable(table), mKey(key), mTimeout(timeout) {}
+
+			bool await_ready() const noexcept { return false; }
+
+			// a second wait on the same key finishes at once, empty
+			bool await_suspend(std::coroutine_handle<> h)
+			{
+				auto ret = mTable.mWaiters.emplace(mKey, Waiter());
+				if (!ret.second) return false;
+
+				Waiter& waiter = ret.first->second;
+				waiter.handle = h;
+				waiter.result = &mResult;
+				waiter.timerID = 0;
+				if (mTimeout != 0)
+				{
+					ReplyTable* table = &mTable;
+					Key key = mKey;
+					waiter.timerID = mTable.mSerial.Expire(mTimeout, [table, key](uint) { table->Resolve(key, nullptr); });
+				}
+				return true;
+			}
+
+			std::optional<T> await_resume() { return std::move(mResult); }
+
+		private:
+			ReplyTable&      mTable;
+			Key              mKey;
+			uint             mTimeout;
+			std::optional<T> mResult;
+		};
+
+		// must be awaited on the serial thread. timeout: milliseconds, 0 waits forever
+		Awaiter Wait(const Key& key, uint timeout)
+		{
+			return Awaiter(*this, key, timeout);
+		}
+
+		// late or unknown replies are dropped
+		void Complete(const Key& key, T value)
+		{
+			mSerial.Post([this, key, value]() mutable { Resolve(key, &value); });
+		}
+
+		// serial thread only
+		size_t Size() const { return mWaiters.size(); }
+
+	private:
+		struct Waiter
+		{
+			std::coroutine_handle<> handle;
+			std::optional<T>*       result;
+			uint                    timerID;
+		};
+
+		// value nullptr: timed out
+		void Resolve(const Key& key, T* value)
+		{
+			auto iter = mWaiters.find(key);
+			if (iter == mWaiters.end()) return;
+
+			Waiter waiter = iter->second;
+			mWaiters.erase(iter);
+			if (value != nullptr)
+			{
+				if (waiter.timerID != 0)
+					mSerial.RemoveTimer(waiter.timerID);
+				waiter.result->emplace(std::move(*value));
+			}
+			waiter.handle.resume();
+		}
+
+	private:
+		ReplyTable(const ReplyTable&) = delete;
+		ReplyTable& operator=(const ReplyTable&) = delete;
+
+	private:
+		Serial& mSerial;
+		std::unordered_map<Key, Waiter> mWaiters;
+	};
+}
+
+#endif
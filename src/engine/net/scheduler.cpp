@@ -53,9 +53,12 @@ void Scheduler::Start()
 	{
 		mCore->threads[i].swap(std::thread([&]()
 		{
+			utils::SetThreadAffinity(mCore->affinity);
+			utils::SetThreadName("net-io");
 			mCore->service.run();
 		}));
 	}
+	mCore->taskPool.Start(mCore->taskThreadNum);
 	mCore->serial.Start();
 }
 
@@ -70,6 +73,7 @@ void Scheduler::Stop()
 		if (mCore->threads[i].joinable())
 			mCore->threads[i].join();
 	}
+	mCore->taskPool.Stop();
 	mCore->serial.Stop();
 }
 
@@ -84,7 +88,47 @@ uint net::Scheduler::GetWorkerNum()
 	return mCore->threads.size();
 }
 
+void net::Scheduler::SetWorkerAffinity(const utils::CPUSet& cpus)
+{
+	if (mCore->working) return;
+	mCore->affinity = cpus;
+}
+
+void net::Scheduler::SetTaskAffinity(const utils::CPUSet& cpus)
+{
+	if (mCore->working) return;
+	mCore->taskPool.SetAffinity(cpus);
+}
+
+void net::Scheduler::SetNode(int node)
+{
+	if (mCore->working) return;
+	utils::CPUSet cpus = utils::GetNodeCPUs(node);
+	if (cpus.empty()) return;
+	SetWorkerAffinity(cpus);
+	SetTaskAffinity(cpus);
+	mCore->serial.SetAffinity(cpus);
+}
+
 Serial & net::Scheduler::GetSerial()
 {
 	return mCore->serial;
 }
+
+
+void net::Scheduler::SetTaskThreadNum(uint n)
+{
+	if (mCore->working) return;
+	mCore->taskThreadNum = n;
+}
+
+uint net::Scheduler::GetTaskThreadNum()
+{
+	if (mCore->working) return mCore->taskPool.GetThreadNum();
+	return mCore->taskThreadNum;
+}
+
+utils::TaskPool& net::Scheduler::GetTaskPool()
+{
+	return mCore->taskPool;
+}
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <utils/typedef.h>
 #include <utils/singleton.h>
 #include <utils/serial.h>
+#include <utils/task_pool.h>
 #include <memory>
 
 namespace net
@@ -26,8 +27,25 @@ namespace net
 
 		uint GetWorkerNum();
 
+		// before Start(): cpus for the io threads (named "net-io"), the task pool and the serial.
+		// empty: left to the os
+		void SetWorkerAffinity(const utils::CPUSet& cpus);
+
+		void SetTaskAffinity(const utils::CPUSet& cpus);
+
+		// io threads, task pool and serial all on the cpus of one numa node
+		void SetNode(int node);
+
 		Serial& GetSerial();
 
+		// threads of the cpu task pool, 0: one per hardware thread.
+		// separate from the io worker threads
+		void SetTaskThreadNum(uint n);
+
+		uint GetTaskThreadNum();
+
+		utils::TaskPool& GetTaskPool();
+
 	private:
 		struct Core;
 		std::shared_ptr<Core> mCore;
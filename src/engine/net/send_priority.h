@@ -0,0 +1,18 @@
+#ifndef __NET_SEND_PRIORITY_HEADER__
+#define __NET_SEND_PRIORITY_HEADER__
+
+namespace net
+{
+	// every connection keeps one send queue per class,
+	// higher classes are written first at frame boundaries
+	enum class SendPriority
+	{
+		Control, // kick, heartbeat, combat results
+		Normal,
+		Bulk,    // inventory dumps, chat history
+
+		Count,
+	};
+}
+
+#endif
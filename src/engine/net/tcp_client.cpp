@@ -2,17 +2,109 @@
 #include "internal-header.h"
 #include "scheduler.h"
 #include "internal-scheduler.h"
+#include "internal-send-lanes.h"
+#include "internal-packet-pool.h"
+#include <asio/steady_timer.hpp>
+#include <chrono>
 #include <map>
 #include <mutex>
 #include <memory>
+#include <string>
+#include <system_error>
 #include <vector>
-#include <sstream>
 
 using namespace net;
 using namespace asio;
 using namespace asio::ip;
 using namespace std::placeholders;
 
+/////////////////////////////////////////////////////////////////////////////
+// resolved endpoints, shared by all TCPClient sessions
+class ResolveCache
+{
+public:
+	typedef std::vector<tcp::endpoint> Endpoints;
+
+	ResolveCache() : mTTL(std::chrono::seconds(60)) {}
+
+	void SetTTL(const std::chrono::steady_clock::duration& ttl)
+	{
+		std::lock_guard<std::mutex> guard(mMutex);
+		mTTL = ttl;
+		if (mTTL.count() == 0)
+			mEntries.clear();
+	}
+
+	std::chrono::steady_clock::duration GetTTL()
+	{
+		std::lock_guard<std::mutex> guard(mMutex);
+		return mTTL;
+	}
+
+	bool Find(const std::string& key, Endpoints& out)
+	{
+		std::lock_guard<std::mutex> guard(mMutex);
+		auto iter = mEntries.find(key);
+		if (iter == mEntries.end()) return false;
+		if (iter->second.expireTime <= std::chrono::steady_clock::now())
+		{
+			mEntries.erase(iter);
+			return false;
+		}
+		out = iter->second.endpoints;
+		return true;
+	}
+
+	void Insert(const std::string& key, const Endpoints& endpoints)
+	{
+		std::lock_guard<std::mutex> guard(mMutex);
+		if (mTTL.count() == 0 || endpoints.empty()) return;
+		Entry& entry = mEntries[key];
+		entry.endpoints = endpoints;
+		entry.expireTime = std::chrono::steady_clock::now() + mTTL;
+	}
+
+	void Erase(const std::string& key)
+	{
+		std::lock_guard<std::mutex> guard(mMutex);
+		mEntries.erase(key);
+	}
+
+private:
+	struct Entry
+	{
+		Endpoints endpoints;
+		std::chrono::steady_clock::time_point expireTime;
+	};
+
+	std::mutex mMutex;
+	std::chrono::steady_clock::duration mTTL;
+	std::map<std::string, Entry> mEntries;
+};
+
+// alternate address families so that a broken family only costs one attempt delay
+static void InterleaveFamilies(ResolveCache::Endpoints& endpoints)
+{
+	if (endpoints.size() < 3) return;
+
+	bool firstV6 = endpoints[0].address().is_v6();
+	ResolveCache::Endpoints first, second;
+	for (auto& endpoint : endpoints)
+	{
+		if (endpoint.address().is_v6() == firstV6)
+			first.push_back(endpoint);
+		else
+			second.push_back(endpoint);
+	}
+
+	endpoints.clear();
+	for (size_t i = 0; i < first.size() || i < second.size(); ++i)
+	{
+		if (i < first.size()) endpoints.push_back(first[i]);
+		if (i < second.size()) endpoints.push_back(second[i]);
+	}
+}
+
 /////////////////////////////////////////////////////////////////////////////
 class TCPClientSession : public std::enable_shared_from_this<TCPClientSession>
 {
@@ -28,6 +120,9 @@ public:
 		uint                connID,
 		Serial&				serial,
 		io_service&         service,
+		ResolveCache&       resolveCache,
+		uint                attemptDelay,
+		uint                starvationLimit,
 		OnConnectionHandler onConnection,
 		OnCloseHandler      onClose,
 		OnRecvHandler       onRecv)
@@ -37,20 +132,52 @@ public:
 		, mConnID(connID)
 		, mSocket(service)
 		, mResolver(service)
+		, mResolveCache(resolveCache)
+		, mAttemptTimer(service)
+		, mAttemptDelay(std::chrono::milliseconds(attemptDelay))
+		, mNextEndpoint(0)
+		, mRunningAttempts(0)
+		, mConnected(false)
+		, mClosing(false)
+		, mWritable(false)
+		, mWriting(false)
 		, mOnConnectionHandler(onConnection)
 		, mOnRecvHandler(onRecv)
-		, mOnCloseHandler(onClose) {}
+		, mOnCloseHandler(onClose)
+	{
+		mLanes.SetStarvationLimit(starvationLimit);
+	}
 
 	~TCPClientSession() {}
 
 	tcp::socket& getSocket() { return mSocket; }
 	uint getConnID() { return mConnID; }
 
-	void resolve(const std::string& ip, const std::string& port)
+	void resolve(const std::string& host, int port)
 	{
 		try
 		{
-			tcp::resolver::query query(ip, port);
+			// literal address, nothing to resolve
+			asio::error_code err;
+			auto addr = address::from_string(host, err);
+			if (!err)
+			{
+				ResolveCache::Endpoints endpoints(1, tcp::endpoint(addr, (unsigned short)port));
+				postConnectionHandler(TCPClient::Result::AddrResolveSuccessed, std::error_code());
+				connect(endpoints);
+				return;
+			}
+
+			mCacheKey = host + ":" + std::to_string(port);
+			ResolveCache::Endpoints endpoints;
+			if (mResolveCache.Find(mCacheKey, endpoints))
+			{
+				postConnectionHandler(TCPClient::Result::AddrResolveSuccessed, std::error_code());
+				connect(endpoints);
+				return;
+			}
+
+			tcp::resolver::query query(host, std::to_string(port));
 			auto handler = std::bind(&TCPClientSession::handle_resolve, shared_from_this(), _1, _2);
 			mResolver.async_resolve(query, handler);
 		}
@@ -59,18 +186,18 @@ public:
 		}
 	}
 
-	size_t send(const void* data, size_t len)
+	size_t send(const void* data, size_t len, SendPriority priority)
 	{
 		try
 		{
-			byte buf[4];
-			buf[0] = byte(len);
-			buf[1] = byte(len >> 8);
-			buf[2] = 24;
-			buf[3] = 0;
-
-			asio::write(mSocket, asio::buffer(buf, 4));
-			return asio::write(mSocket, asio::buffer(data, len));
+			std::lock_guard<std::mutex> guard(mSendMutex);
+			mLanes.Push(priority, data, len);
+			if (mWritable && !mWriting)
+			{
+				mWriting = true;
+				write_next();
+			}
+			return len;
 		}
 		catch (...)
 		{
@@ -78,10 +205,26 @@ public:
 		return 0;
 	}
 
+	size_t getSendQueueDepth(SendPriority priority)
+	{
+		std::lock_guard<std::mutex> guard(mSendMutex);
+		return mLanes.GetDepth(priority);
+	}
+
 	void close()
 	{
 		try
 		{
+			// still connecting: the attempts are closed and ConnectionFailed is reported
+			std::lock_guard<std::mutex> guard(mConnectMutex);
+			mClosing = true;
+			mAttemptTimer.cancel();
+			for (auto& attempt : mAttempts)
+			{
+				asio::error_code ignored;
+				attempt->close(ignored);
+			}
+
 			if (!mSocket.is_open()) return;
 			mSocket.shutdown(socket_base::shutdown_both);
 		}
@@ -92,48 +235,190 @@ public:
 
 	void postClosedHandler()
 	{
-		mSerial.Post(std::bind(mOnCloseHandler, getConnID()));
+		mSerial.Post(std::bind(&TCPClientSession::closed_handler, shared_from_this()), Serial::Priority::Critical);
+	}
+
+	// the message is made on the serial, the posted handler stays small
+	void postConnectionHandler(TCPClient::Result result, const std::error_code& ec)
+	{
+		mSerial.Post(std::bind(&TCPClientSession::connection_handler, shared_from_this(), result, ec), Serial::Priority::Critical);
 	}
 
 private:
+	// mSendMutex must be held
+	void write_next()
+	{
+		if (!mLanes.Pop(mWriteFrame))
+		{
+			mWriting = false;
+			return;
+		}
+
+		auto handler = std::bind(&TCPClientSession::handle_write, shared_from_this(), _1, _2);
+		asio::async_write(mSocket, asio::buffer(mWriteFrame), handler);
+	}
+
+	void handle_write(std::error_code ec, std::size_t bytes)
+	{
+		try
+		{
+			std::lock_guard<std::mutex> guard(mSendMutex);
+			if (ec)
+			{
+				// the read side reports the broken connection
+				mLanes.Clear();
+				mWriting = false;
+				return;
+			}
+			write_next();
+		}
+		catch (...)
+		{
+		}
+	}
+
 	void handle_resolve(const std::error_code& ec, tcp::resolver::iterator endpoint_iterator)
 	{
 		try
 		{
 			if (ec)
 			{
-				mSerial.Post(std::bind(mOnConnectionHandler, getConnID(), TCPClient::Result::AddrResolveFailed, ec.message()));
+				{
+					std::lock_guard<std::mutex> guard(mSendMutex);
+					mLanes.Clear();
+				}
+				postConnectionHandler(TCPClient::Result::AddrResolveFailed, ec);
 				return;
 			}
 
-			mSerial.Post(std::bind(mOnConnectionHandler, getConnID(), TCPClient::Result::AddrResolveSuccessed, ec.message()));
+			postConnectionHandler(TCPClient::Result::AddrResolveSuccessed, ec);
+
+			ResolveCache::Endpoints endpoints;
+			for (tcp::resolver::iterator end; endpoint_iterator != end; ++endpoint_iterator)
+				endpoints.push_back(*endpoint_iterator);
+
+			InterleaveFamilies(endpoints);
+			mResolveCache.Insert(mCacheKey, endpoints);
 
-			connect(endpoint_iterator);
+			connect(endpoints);
 		}
 		catch (...)
 		{
 		}
 	}
 
-	void connect(const tcp::resolver::iterator& endpoint_iterator)
+	void connect(const ResolveCache::Endpoints& endpoints)
 	{
 		try
 		{
-			mSocket.async_connect(*endpoint_iterator, std::bind(&TCPClientSession::handle_connect, shared_from_this(), _1));
+			std::lock_guard<std::mutex> guard(mConnectMutex);
+			if (mClosing)
+			{
+				connect_failed(std::make_error_code(std::errc::operation_canceled));
+				return;
+			}
+			mEndpoints = endpoints;
+			mNextEndpoint = 0;
+			start_attempt();
 		}
 		catch (...)
 		{
 		}
 	}
 
-	void handle_connect(std::error_code ec)
+	// happy eyeballs: the next endpoint is tried when the running attempts
+	// neither succeed nor fail within the attempt delay.
+	// mConnectMutex must be held.
+	void start_attempt()
+	{
+		if (mNextEndpoint >= mEndpoints.size()) return;
+
+		std::shared_ptr<tcp::socket> socket(new tcp::socket(mService));
+		mAttempts.push_back(socket);
+		++mRunningAttempts;
+		socket->async_connect(mEndpoints[mNextEndpoint++], std::bind(&TCPClientSession::handle_connect, shared_from_this(), socket, _1));
+
+		if (mNextEndpoint < mEndpoints.size())
+		{
+			mAttemptTimer.expires_from_now(mAttemptDelay);
+			mAttemptTimer.async_wait(std::bind(&TCPClientSession::handle_attempt_timer, shared_from_this(), _1));
+		}
+	}
+
+	void handle_attempt_timer(const std::error_code& ec)
+	{
+		if (ec) return; // already cancel
+
+		try
+		{
+			std::lock_guard<std::mutex> guard(mConnectMutex);
+			if (mConnected || mClosing) return;
+			start_attempt();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	// no attempt is left. frames sent while connecting are dropped, a session isn't connected again.
+	// mConnectMutex must be held
+	void connect_failed(const std::error_code& ec)
+	{
+		mAttempts.clear();
+		{
+			std::lock_guard<std::mutex> guard(mSendMutex);
+			mLanes.Clear();
+		}
+		postConnectionHandler(TCPClient::Result::ConnectionFailed, ec);
+	}
+
+	void handle_connect(std::shared_ptr<tcp::socket> socket, std::error_code ec)
 	{
 		try
 		{
-			if (ec)
 			{
-				mSerial.Post(std::bind(mOnConnectionHandler, getConnID(), TCPClient::Result::ConnectionFailed, ec.message()));
-				return;
+				std::lock_guard<std::mutex> guard(mConnectMutex);
+				--mRunningAttempts;
+				if (mConnected) return; // another attempt won
+
+				if (mClosing)
+				{
+					// a late success is dropped too, the last attempt reports the close
+					asio::error_code ignored;
+					socket->close(ignored);
+					if (mRunningAttempts != 0) return;
+
+					connect_failed(std::make_error_code(std::errc::operation_canceled));
+					return;
+				}
+
+				if (ec)
+				{
+					if (mNextEndpoint < mEndpoints.size())
+					{
+						mAttemptTimer.cancel();
+						start_attempt();
+						return;
+					}
+					if (mRunningAttempts != 0) return;
+
+					if (!mCacheKey.empty())
+						mResolveCache.Erase(mCacheKey);
+
+					connect_failed(ec);
+					return;
+				}
+
+				mConnected = true;
+				mAttemptTimer.cancel();
+				for (auto& attempt : mAttempts)
+				{
+					asio::error_code ignored;
+					if (attempt != socket)
+						attempt->close(ignored);
+				}
+				mAttempts.clear();
+				mSocket = std::move(*socket);
 			}
 
 			mBuffer.resize(sizeof(unsigned short));
@@ -143,7 +428,18 @@ private:
 			mSocket.set_option(tcp::socket::send_buffer_size(32 * 1024));
 			mSocket.set_option(tcp::socket::receive_buffer_size(16 * 1024));
 
-			mSerial.Post(std::bind(mOnConnectionHandler, getConnID(), TCPClient::Result::ConnectionSuccessed, ec.message()));
+			{
+				// flush what was sent while connecting
+				std::lock_guard<std::mutex> guard(mSendMutex);
+				mWritable = true;
+				if (!mWriting)
+				{
+					mWriting = true;
+					write_next();
+				}
+			}
+
+			postConnectionHandler(TCPClient::Result::ConnectionSuccessed, ec);
 
 			recv_len();
 		}
@@ -233,9 +529,9 @@ private:
 
 		try
 		{
-			char* packet = new char[bytes];
+			char* packet = AllocPacket(bytes);
 			memcpy(packet, &mBuffer[0], bytes);
-			mSerial.Post(std::bind(&TCPClientSession::packet_handler, shared_from_this(), packet, bytes));
+			mSerial.Post(std::bind(&TCPClientSession::packet_handler, shared_from_this(), packet, bytes), Serial::PostTag::NetRecv, Serial::Priority::Critical);
 		}
 		catch (...)
 		{
@@ -262,19 +558,29 @@ private:
 			for (uint i = 0; i < count; ++i)
 			{
 				if (index + 1 >= length)
-					return;
+					break;
 
 				uint16 single_len = (uint16)(uint8)buf[index] | ((uint16)(uint8)buf[index + 1] << 8);
 
 				if (index + 2 + single_len > length)
-					return;
+					break;
 
 				mOnRecvHandler(getConnID(), &buf[index + 2], single_len);
 				index += 2 + single_len;
 			}
 		}
 
-		delete[] buf;
+		FreePacket(buf, length);
+	}
+
+	void connection_handler(TCPClient::Result result, std::error_code ec)
+	{
+		mOnConnectionHandler(getConnID(), result, ec ? ec.message() : std::string());
+	}
+
+	void closed_handler()
+	{
+		mOnCloseHandler(getConnID());
 	}
 
 private:
@@ -287,6 +593,24 @@ private:
 	tcp::socket   mSocket;
 	tcp::resolver mResolver;
 
+	ResolveCache&           mResolveCache;
+	std::string             mCacheKey;
+	std::mutex              mConnectMutex;
+	asio::steady_timer      mAttemptTimer;
+	std::chrono::steady_clock::duration mAttemptDelay;
+	ResolveCache::Endpoints mEndpoints;
+	size_t                  mNextEndpoint;
+	size_t                  mRunningAttempts;
+	bool                    mConnected;
+	bool                    mClosing; // close() was called, no attempt may connect any more
+	std::vector<std::shared_ptr<tcp::socket> > mAttempts;
+
+	std::mutex       mSendMutex;
+	SendLanes        mLanes;
+	SendLanes::Frame mWriteFrame;
+	bool             mWritable; // mSocket holds the connected socket, frames queue until then
+	bool             mWriting;
+
 	OnConnectionHandler mOnConnectionHandler;
 	OnRecvHandler       mOnRecvHandler;
 	OnCloseHandler      mOnCloseHandler;
@@ -304,6 +628,10 @@ struct TCPClient::Core
 	bool tcp_nodelay;
 	uint send_buffer_size;
 	uint recv_buffer_size;
+	uint connect_attempt_delay;
+	uint send_starvation_limit;
+
+	ResolveCache resolve_cache;
 
 	std::mutex sessions_mutex;
 	std::map<uint, TCPClientSession::Ptr> sessions;
@@ -314,7 +642,9 @@ struct TCPClient::Core
 		, idCounter(0)
 		, tcp_nodelay(true)
 		, send_buffer_size(32 * 1024)
-		, recv_buffer_size(16 * 1924) {}
+		, recv_buffer_size(16 * 1924)
+		, connect_attempt_delay(250)
+		, send_starvation_limit(DEFAULT_SEND_STARVATION_LIMIT) {}
 };
 
 /////////////////////////////////////////////////////////////////////////////
@@ -339,6 +669,9 @@ uint TCPClient::ConnectTo(const ConnectParams& params)
 			++mCore->idCounter,
 			mCore->serial,
 			service,
+			mCore->resolve_cache,
+			mCore->connect_attempt_delay,
+			mCore->send_starvation_limit,
 			params.onConnectionHandler,
 			params.onCloseHandler,
 			params.onRecvHandler));
@@ -346,9 +679,7 @@ uint TCPClient::ConnectTo(const ConnectParams& params)
 		if (!mCore->sessions.insert(std::make_pair(session->getConnID(), session)).second)
 			return 0;
 
-		std::stringstream ss;
-		ss << params.port;
-		session->resolve(params.ip, ss.str());
+		session->resolve(params.ip, params.port);
 
 		return session->getConnID();
 	}
@@ -373,14 +704,29 @@ void TCPClient::Disconnect(uint connID)
 	}
 }
 
-size_t TCPClient::Send(uint connID, const void* data, size_t len)
+size_t TCPClient::Send(uint connID, const void* data, size_t len, SendPriority priority)
+{
+	try
+	{
+		std::unique_lock<std::mutex> lock(mCore->sessions_mutex);
+		auto iter = mCore->sessions.find(connID);
+		if (iter == mCore->sessions.end()) return 0;
+		return iter->second->send(data, len, priority);
+	}
+	catch (...)
+	{
+		return 0;
+	}
+}
+
+size_t TCPClient::GetSendQueueDepth(uint connID, SendPriority priority)
 {
 	try
 	{
 		std::unique_lock<std::mutex> lock(mCore->sessions_mutex);
 		auto iter = mCore->sessions.find(connID);
 		if (iter == mCore->sessions.end()) return 0;
-		return iter->second->send(data, len);
+		return iter->second->getSendQueueDepth(priority);
 	}
 	catch (...)
 	{
@@ -417,3 +763,33 @@ uint TCPClient::GetRecvBufSize()
 {
 	return mCore->recv_buffer_size;
 }
+
+void TCPClient::SetResolveCacheTTL(uint sec)
+{
+	mCore->resolve_cache.SetTTL(std::chrono::seconds(sec));
+}
+
+uint TCPClient::GetResolveCacheTTL()
+{
+	return (uint)std::chrono::duration_cast<std::chrono::seconds>(mCore->resolve_cache.GetTTL()).count();
+}
+
+void TCPClient::SetConnectAttemptDelay(uint millisec)
+{
+	mCore->connect_attempt_delay = millisec;
+}
+
+uint TCPClient::GetConnectAttemptDelay()
+{
+	return mCore->connect_attempt_delay;
+}
+
+void TCPClient::SetSendStarvationLimit(uint val)
+{
+	mCore->send_starvation_limit = val;
+}
+
+uint TCPClient::GetSendStarvationLimit()
+{
+	return mCore->send_starvation_limit;
+}
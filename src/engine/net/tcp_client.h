@@ -3,6 +3,7 @@
 
 #include <utils/typedef.h>
 #include <utils/singleton.h>
+#include <net/send_priority.h>
 #include <functional>
 #include <string>
 #include <memory>
@@ -43,7 +44,11 @@ namespace net
 
 		uint ConnectTo(const ConnectParams& params);
 		void Disconnect(uint connID);
-		size_t Send(uint connID, const void* data, size_t len);
+		// queued (held until connected), returns len or 0 on failure
+		size_t Send(uint connID, const void* data, size_t len, SendPriority priority = SendPriority::Normal);
+
+		// frames waiting in one send class of a connection
+		size_t GetSendQueueDepth(uint connID, SendPriority priority);
 
 		void SetTCPNoDelay(bool val);
 		void SetSendBufSize(uint val);
@@ -52,6 +57,20 @@ namespace net
 		uint GetSendBufSize();
 		uint GetRecvBufSize();
 
+		// resolved endpoints are cached for all connections, 0 disables the cache.
+		// literal addresses never go through the resolver.
+		void SetResolveCacheTTL(uint sec);
+		uint GetResolveCacheTTL();
+
+		// delay before the next resolved endpoint is tried in parallel
+		void SetConnectAttemptDelay(uint millisec);
+		uint GetConnectAttemptDelay();
+
+		// a waiting lower send class is served after this many higher class frames.
+		// default 8, 0: strict priority, lower classes wait while a higher one has frames
+		void SetSendStarvationLimit(uint val);
+		uint GetSendStarvationLimit();
+
 	private:
 		struct Core;
 		std::shared_ptr<Core> mCore;
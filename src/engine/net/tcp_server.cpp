@@ -2,6 +2,9 @@
 #include "internal-header.h"
 #include "scheduler.h"
 #include "internal-scheduler.h"
+#include "internal-send-lanes.h"
+#include "internal-packet-pool.h"
+#include <atomic>
 #include <map>
 #include <mutex>
 #include <vector>
@@ -15,6 +18,15 @@ typedef TCPServer::OnConnectedHandler OnConnectedHandler;
 typedef TCPServer::OnCloseHandler     OnCloseHandler;
 typedef TCPServer::OnRecvHandler      OnRecvHandler;
 
+// idle memory mode: every session served by one io thread reads into this buffer
+enum { SHARED_RECV_BUFFER_SIZE = 64 * 1024 };
+
+static byte* GetSharedRecvBuffer()
+{
+	static thread_local std::vector<byte> buffer(SHARED_RECV_BUFFER_SIZE);
+	return &buffer[0];
+}
+
 /////////////////////////////////////////////////////////////////////////////
 struct CoreShare
 {
@@ -27,6 +39,8 @@ struct CoreShare
 	bool tcp_nodelay;
 	uint send_buffer_size;
 	uint recv_buffer_size;
+	bool idle_memory_mode;
+	uint send_starvation_limit;
 
 	std::function<bool(uint)> Close;
 
@@ -35,6 +49,8 @@ struct CoreShare
 		, tcp_nodelay(false)
 		, send_buffer_size(32 * 1024)
 		, recv_buffer_size(16 * 1024)
+		, idle_memory_mode(false)
+		, send_starvation_limit(DEFAULT_SEND_STARVATION_LIMIT)
 	{}
 };
 
@@ -49,20 +65,33 @@ public:
 	tcp::socket& GetSocket() { return mSocket; }
 	uint GetConnID() { return mConnID; }
 	void Start();
-	size_t Send(const void* data, size_t len);
+	size_t Send(const void* data, size_t len, SendPriority priority);
 	bool Close();
+	size_t GetMemoryUsage();
+	size_t GetSendQueueDepth(SendPriority priority);
 
 private:
+	void write_next();
+	void handle_write(std::error_code ec, std::size_t bytes);
 	void recv_len();
 	void handle_recv_len(std::error_code ec, std::size_t bytes);
 	void handle_recv_body(std::error_code ec, std::size_t bytes);
+	void wait_readable();
+	void handle_readable(std::error_code ec);
+	size_t split_frames(const byte* data, size_t len);
 	void packet_handler(char* buf, uint length);
 
 private:
 	CoreShare&        mCore;
 	uint              mConnID;
 	tcp::socket       mSocket;
-	std::vector<byte> mBuffer;
+	std::vector<byte> mBuffer; // idle memory mode: only the pending partial frame
+	std::atomic<size_t> mBufferBytes; // mBuffer.capacity(), set by the io thread for GetMemoryUsage()
+
+	std::mutex         mSendMutex;
+	SendLanes          mLanes;
+	SendLanes::Frame   mWriteFrame;
+	bool               mWriting;
 };
 
 /////////////////////////////////////////////////////////////////////////////
@@ -124,7 +153,10 @@ void TCPServer::Core::HandleAccept(TCPServerSession::Ptr session, std::error_cod
 		}
 		if (insertSuccess)
 		{
-			share.serial.Post(std::bind(share.onConnectedHandler, session->GetConnID()));
+			// the share outlives the serial's handlers, like the sessions' packet handlers
+			CoreShare* pshare = &share;
+			uint connID = session->GetConnID();
+			share.serial.Post([pshare, connID]() { pshare->onConnectedHandler(connID); }, Serial::Priority::Critical);
 			session->Start();
 		}
 	}
@@ -141,7 +173,8 @@ bool TCPServer::Core::Close(uint connID)
 		if (iter == sessions.end()) return false;
 		iter->second->Close();
 		sessions.erase(iter);
-		share.serial.Post(std::bind(share.onCloseHandler, connID));
+		CoreShare* pshare = &share;
+		share.serial.Post([pshare, connID]() { pshare->onCloseHandler(connID); }, Serial::Priority::Critical);
 		return true;
 	}
 	catch (...)
@@ -156,33 +189,47 @@ TCPServerSession::TCPServerSession(CoreShare& core, uint connID, io_service & se
 	: mCore(core)
 	, mConnID(connID)
 	, mSocket(service)
+	, mBufferBytes(0)
+	, mWriting(false)
 {
 }
 
 inline void TCPServerSession::Start()
 {
-	mBuffer.resize(sizeof(uint16));
-
 	mSocket.set_option(tcp::no_delay(mCore.tcp_nodelay));
 	mSocket.set_option(tcp::socket::keep_alive(false));
 	mSocket.set_option(tcp::socket::send_buffer_size(mCore.send_buffer_size));
 	mSocket.set_option(tcp::socket::receive_buffer_size(mCore.recv_buffer_size));
 
+	{
+		std::lock_guard<std::mutex> guard(mSendMutex);
+		mLanes.SetStarvationLimit(mCore.send_starvation_limit);
+	}
+
+	if (mCore.idle_memory_mode)
+	{
+		mSocket.non_blocking(true);
+		wait_readable();
+		return;
+	}
+
+	mBuffer.resize(sizeof(uint16));
+	mBufferBytes.store(mBuffer.capacity(), std::memory_order_relaxed);
 	recv_len();
 }
 
-inline size_t TCPServerSession::Send(const void * data, size_t len)
+inline size_t TCPServerSession::Send(const void * data, size_t len, SendPriority priority)
 {
 	try
 	{
-		byte buf[4];
-		buf[0] = byte(len);
-		buf[1] = byte(len >> 8);
-		buf[2] = 24;
-		buf[3] = 0;
-
-		asio::write(mSocket, asio::buffer(buf, 4));
-		return asio::write(mSocket, asio::buffer(data, len));
+		std::lock_guard<std::mutex> guard(mSendMutex);
+		mLanes.Push(priority, data, len);
+		if (!mWriting)
+		{
+			mWriting = true;
+			write_next();
+		}
+		return len;
 	}
 	catch (...)
 	{
@@ -190,10 +237,52 @@ inline size_t TCPServerSession::Send(const void * data, size_t len)
 	}
 }
 
+// mSendMutex must be held
+inline void TCPServerSession::write_next()
+{
+	if (!mLanes.Pop(mWriteFrame))
+	{
+		mWriting = false;
+		return;
+	}
+
+	auto handler = std::bind(&TCPServerSession::handle_write, shared_from_this(), _1, _2);
+	asio::async_write(mSocket, asio::buffer(mWriteFrame), handler);
+}
+
+inline void TCPServerSession::handle_write(std::error_code ec, std::size_t bytes)
+{
+	try
+	{
+		std::lock_guard<std::mutex> guard(mSendMutex);
+		if (ec)
+		{
+			// the read side reports the broken connection
+			mLanes.Clear();
+			mWriting = false;
+			return;
+		}
+		write_next();
+	}
+	catch (...)
+	{
+	}
+}
+
+inline size_t TCPServerSession::GetSendQueueDepth(SendPriority priority)
+{
+	std::lock_guard<std::mutex> guard(mSendMutex);
+	return mLanes.GetDepth(priority);
+}
+
 inline bool TCPServerSession::Close()
 {
 	try
 	{
+		{
+			std::lock_guard<std::mutex> guard(mSendMutex);
+			mLanes.Clear();
+		}
 		if (!mSocket.is_open()) return false;
 		mSocket.shutdown(socket_base::shutdown_both);
 		mSocket.close();
@@ -205,6 +294,12 @@ inline bool TCPServerSession::Close()
 	}
 }
 
+inline size_t TCPServerSession::GetMemoryUsage()
+{
+	std::lock_guard<std::mutex> guard(mSendMutex);
+	return sizeof(TCPServerSession) + mBufferBytes.load(std::memory_order_relaxed) + mLanes.GetQueuedBytes() + mWriteFrame.capacity();
+}
+
 inline void TCPServerSession::recv_len()
 {
 	try
@@ -248,7 +343,10 @@ inline void TCPServerSession::handle_recv_len(std::error_code ec, std::size_t by
 		// ܳ + ͣ/
 		uint16 length = (uint16)(uint8)mBuffer[0] | ((uint16)(uint8)mBuffer[1] << 8);
 		if (mBuffer.size() < size_t(length + 2))
+		{
 			mBuffer.resize(length + 2);
+			mBufferBytes.store(mBuffer.capacity(), std::memory_order_relaxed);
+		}
 
 		auto handler = std::bind(&TCPServerSession::handle_recv_body, shared_from_this(), _1, _2);
 		asio::async_read(mSocket, asio::buffer(&mBuffer[0], length + 2), handler);
@@ -285,9 +383,9 @@ inline void TCPServerSession::handle_recv_body(std::error_code ec, std::size_t b
 
 	try
 	{
-		char* packet = new char[bytes];
+		char* packet = AllocPacket(bytes);
 		memcpy(packet, &mBuffer[0], bytes);
-		mCore.serial.Post(std::bind(&TCPServerSession::packet_handler, shared_from_this(), packet, bytes));
+		mCore.serial.Post(std::bind(&TCPServerSession::packet_handler, shared_from_this(), packet, bytes), Serial::PostTag::NetRecv, Serial::Priority::Critical);
 	}
 	catch (...)
 	{
@@ -295,6 +393,90 @@ inline void TCPServerSession::handle_recv_body(std::error_code ec, std::size_t b
 	recv_len();
 }
 
+inline void TCPServerSession::wait_readable()
+{
+	try
+	{
+		// zero-byte read, no buffer is held while the connection is idle
+		auto handler = std::bind(&TCPServerSession::handle_readable, shared_from_this(), _1);
+		mSocket.async_read_some(asio::null_buffers(), handler);
+	}
+	catch (...)
+	{
+	}
+}
+
+inline void TCPServerSession::handle_readable(std::error_code ec)
+{
+	if (ec)
+	{
+		mCore.Close(GetConnID());
+		return;
+	}
+
+	try
+	{
+		byte* buf = GetSharedRecvBuffer();
+		for (;;)
+		{
+			asio::error_code err;
+			size_t bytes = mSocket.read_some(asio::buffer(buf, SHARED_RECV_BUFFER_SIZE), err);
+			if (err == asio::error::would_block || err == asio::error::try_again)
+				break;
+
+			if (err)
+			{
+				mCore.Close(GetConnID());
+				return;
+			}
+
+			if (mBuffer.empty())
+			{
+				size_t used = split_frames(buf, bytes);
+				if (used < bytes)
+					mBuffer.assign(buf + used, buf + bytes);
+			}
+			else
+			{
+				mBuffer.insert(mBuffer.end(), buf, buf + bytes);
+				size_t used = split_frames(&mBuffer[0], mBuffer.size());
+				if (used == mBuffer.size())
+					std::vector<byte>().swap(mBuffer);
+				else
+					mBuffer.erase(mBuffer.begin(), mBuffer.begin() + used);
+			}
+
+			if (bytes < SHARED_RECV_BUFFER_SIZE)
+				break;
+		}
+	}
+	catch (...)
+	{
+	}
+	mBufferBytes.store(mBuffer.capacity(), std::memory_order_relaxed);
+	wait_readable();
+}
+
+// |--length(2)--|--label(2)--|--body(length)--|
+// returns bytes consumed by complete frames
+inline size_t TCPServerSession::split_frames(const byte* data, size_t len)
+{
+	size_t used = 0;
+	while (len - used >= sizeof(uint16))
+	{
+		uint16 length = (uint16)data[used] | ((uint16)data[used + 1] << 8);
+		size_t frameSize = sizeof(uint16) + length + 2;
+		if (len - used < frameSize)
+			break;
+
+		char* packet = AllocPacket(length + 2);
+		memcpy(packet, data + used + sizeof(uint16), length + 2);
+		mCore.serial.Post(std::bind(&TCPServerSession::packet_handler, shared_from_this(), packet, length + 2), Serial::PostTag::NetRecv, Serial::Priority::Critical);
+		used += frameSize;
+	}
+	return used;
+}
+
 inline void TCPServerSession::packet_handler(char * buf, uint length)
 {
 	// ܳ + ͣ/
@@ -314,19 +496,19 @@ inline void TCPServerSession::packet_handler(char * buf, uint length)
 		for (uint i = 0; i < count; ++i)
 		{
 			if (index + 1 >= length)
-				return;
+				break;
 
 			uint16 singleLen = (uint16)(uint8)buf[index] | ((uint16)(uint8)buf[index + 1] << 8);
 
 			if (index + 2 + singleLen > length)
-				return;
+				break;
 
 			mCore.onRecvHandler(GetConnID(), &buf[index + 2], singleLen);
 			index += 2 + singleLen;
 		}
 	}
 
-	delete[] buf;
+	FreePacket(buf, length);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -405,14 +587,33 @@ void TCPServer::Stop()
 	}
 }
 
-int TCPServer::Send(uint connID, const void *data, size_t len)
+size_t TCPServer::GetConnMemoryUsage(uint connID)
+{
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	auto iter = mCore->sessions.find(connID);
+	if (iter == mCore->sessions.end()) return 0;
+	return iter->second->GetMemoryUsage();
+}
+
+size_t TCPServer::GetMemoryUsage()
+{
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	size_t total = 0;
+	for (auto & pair : mCore->sessions)
+	{
+		total += pair.second->GetMemoryUsage();
+	}
+	return total;
+}
+
+int TCPServer::Send(uint connID, const void *data, size_t len, SendPriority priority)
 {
 	try
 	{
 		std::lock_guard<std::mutex> guard(mCore->mutex);
 		auto iter = mCore->sessions.find(connID);
 		if (iter == mCore->sessions.end()) return 0;
-		return iter->second->Send(data, len);
+		return iter->second->Send(data, len, priority);
 	}
 	catch (...)
 	{
@@ -420,6 +621,14 @@ int TCPServer::Send(uint connID, const void *data, size_t len)
 	}
 }
 
+size_t TCPServer::GetSendQueueDepth(uint connID, SendPriority priority)
+{
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	auto iter = mCore->sessions.find(connID);
+	if (iter == mCore->sessions.end()) return 0;
+	return iter->second->GetSendQueueDepth(priority);
+}
+
 bool TCPServer::Close(uint connID)
 {
 	return mCore->Close(connID);
@@ -440,6 +649,16 @@ void TCPServer::SetRecvBufSize(uint val)
 	mCore->share.recv_buffer_size = val;
 }
 
+void TCPServer::SetIdleMemoryMode(bool val)
+{
+	mCore->share.idle_memory_mode = val;
+}
+
+void TCPServer::SetSendStarvationLimit(uint val)
+{
+	mCore->share.send_starvation_limit = val;
+}
+
 bool TCPServer::GetTCPNoDelay()
 {
 	return mCore->share.tcp_nodelay;
@@ -454,3 +673,13 @@ uint TCPServer::GetRecvBufSize()
 {
 	return mCore->share.recv_buffer_size;
 }
+
+bool TCPServer::GetIdleMemoryMode()
+{
+	return mCore->share.idle_memory_mode;
+}
+
+uint TCPServer::GetSendStarvationLimit()
+{
+	return mCore->share.send_starvation_limit;
+}
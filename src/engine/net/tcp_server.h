@@ -2,6 +2,7 @@
 #define __NET_TCPSERVER_HEADER__
 
 #include <utils/typedef.h>
+#include <net/send_priority.h>
 #include <functional>
 #include <memory>
 #include <string>
@@ -34,9 +35,17 @@ namespace net
 		bool Start();
 		void Stop();
 
-		int Send(uint connID, const void* data, size_t len);
+		// queued, returns len or 0 on failure
+		int Send(uint connID, const void* data, size_t len, SendPriority priority = SendPriority::Normal);
 		bool Close(uint connID);
 
+		// frames waiting in one send class of a connection
+		size_t GetSendQueueDepth(uint connID, SendPriority priority);
+
+		// user space memory held by one connection / all connections, in bytes
+		size_t GetConnMemoryUsage(uint connID);
+		size_t GetMemoryUsage();
+
 		void SetTCPNoDelay(bool val);
 		void SetSendBufSize(uint val);
 		void SetRecvBufSize(uint val);
@@ -44,6 +53,18 @@ namespace net
 		uint GetSendBufSize();
 		uint GetRecvBufSize();
 
+		// idle memory mode, set before Start():
+		// wait for readability with zero-byte reads and read into a buffer shared per io thread,
+		// a connection only holds a buffer while a partial frame is pending.
+		// kernel buffers are still sized by SetSendBufSize()/SetRecvBufSize().
+		void SetIdleMemoryMode(bool val);
+		bool GetIdleMemoryMode();
+
+		// a waiting lower send class is served after this many higher class frames.
+		// default 8, 0: strict priority, lower classes wait while a higher one has frames
+		void SetSendStarvationLimit(uint val);
+		uint GetSendStarvationLimit();
+
 	private:
 		struct Core;
 		std::shared_ptr<Core> mCore;
@@ -0,0 +1,71 @@
+#ifndef __UTILS_FRAME_POOL_HEADER__
+#define __UTILS_FRAME_POOL_HEADER__
+
+#include <utils/node_pool.h>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace utils
+{
+	// pooled memory for coroutine frames, in size classes of 64 bytes up to 2KB.
+	// larger frames go to operator new
+	class FramePool
+	{
+	public:
+		enum
+		{
+			GRANULE = 64,
+			CLASSES = 32,
+		};
+
+		static void* Alloc(size_t size)
+		{
+			size_t index = (size + GRANULE - 1) / GRANULE;
+			if (index == 0 || index > CLASSES)
+				return ::operator new(size);
+			return GetTable<std::make_index_sequence<CLASSES> >::allocs[index - 1]();
+		}
+
+		static void Free(void* p, size_t size)
+		{
+			size_t index = (size + GRANULE - 1) / GRANULE;
+			if (index == 0 || index > CLASSES)
+			{
+				::operator delete(p);
+				return;
+			}
+			GetTable<std::make_index_sequence<CLASSES> >::frees[index - 1](p);
+		}
+
+	private:
+		template<size_t Size>
+		union Block
+		{
+			Block* poolNext;
+			alignas(std::max_align_t) unsigned char data[Size];
+
+			Block() : poolNext(nullptr) {}
+		};
+
+		template<size_t Index>
+		struct Class
+		{
+			typedef Block<(Index + 1) * GRANULE> BlockType;
+
+			static void* Alloc() { return NodePool<BlockType>::Alloc(); }
+			static void Free(void* p) { NodePool<BlockType>::Free(static_cast<BlockType*>(p)); }
+		};
+
+		template<typename Seq> struct GetTable;
+
+		template<size_t... I>
+		struct GetTable<std::index_sequence<I...> >
+		{
+			static constexpr void* (*allocs[])() = { &Class<I>::Alloc... };
+			static constexpr void (*frees[])(void*) = { &Class<I>::Free... };
+		};
+	};
+}
+
+#endif
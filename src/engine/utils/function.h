@@ -0,0 +1,174 @@
+#ifndef __UTILS_FUNCTION_HEADER__
+#define __UTILS_FUNCTION_HEADER__
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace utils
+{
+	template<typename Signature, size_t Capacity = 64> class Function;
+
+	// move-only replacement of std::function, the callable is always stored inline.
+	// a callable larger than Capacity fails to compile instead of allocating:
+	// capture less (a shared_ptr instead of the object) or raise Capacity.
+	template<typename R, typename... Args, size_t Capacity>
+	class Function<R(Args...), Capacity>
+	{
+	public:
+		Function() : mOps(nullptr) {}
+
+		Function(std::nullptr_t) : mOps(nullptr) {}
+
+		template<typename F, typename = typename std::enable_if<
+			!std::is_same<typename std::decay<F>::type, Function>::value>::type>
+		Function(F&& f)
+			: mOps(nullptr)
+		{
+			Assign(std::forward<F>(f));
+		}
+
+		Function(Function&& rh) noexcept
+			: mOps(nullptr)
+		{
+			MoveFrom(rh);
+		}
+
+		~Function()
+		{
+			Reset();
+		}
+
+		Function& operator=(Function&& rh) noexcept
+		{
+			if (this != &rh)
+			{
+				Reset();
+				MoveFrom(rh);
+			}
+			return *this;
+		}
+
+		Function& operator=(std::nullptr_t)
+		{
+			Reset();
+			return *this;
+		}
+
+		template<typename F, typename = typename std::enable_if<
+			!std::is_same<typename std::decay<F>::type, Function>::value>::type>
+		Function& operator=(F&& f)
+		{
+			Reset();
+			Assign(std::forward<F>(f));
+			return *this;
+		}
+
+		R operator()(Args... args) const
+		{
+			return mOps->invoke(const_cast<void*>(static_cast<const void*>(&mStorage)), std::forward<Args>(args)...);
+		}
+
+		explicit operator bool() const { return mOps != nullptr; }
+
+		void swap(Function& rh)
+		{
+			Function temp(std::move(rh));
+			rh = std::move(*this);
+			*this = std::move(temp);
+		}
+
+	private:
+		Function(const Function&) = delete;
+		Function& operator=(const Function&) = delete;
+
+		struct Ops
+		{
+			R    (*invoke)(void* self, Args&&... args);
+			void (*move)(void* to, void* from);
+			void (*destroy)(void* self);
+		};
+
+		template<typename F>
+		struct OpsFor
+		{
+			static R Invoke(void* self, Args&&... args)
+			{
+				return static_cast<R>((*static_cast<F*>(self))(std::forward<Args>(args)...));
+			}
+
+			static void Move(void* to, void* from)
+			{
+				new (to) F(std::move(*static_cast<F*>(from)));
+				static_cast<F*>(from)->~F();
+			}
+
+			static void Destroy(void* self)
+			{
+				static_cast<F*>(self)->~F();
+			}
+
+			static const Ops* Get()
+			{
+				static const Ops ops = { &Invoke, &Move, &Destroy };
+				return &ops;
+			}
+		};
+
+		template<typename F>
+		void Assign(F&& f)
+		{
+			typedef typename std::decay<F>::type Callable;
+			static_assert(sizeof(Callable) <= Capacity, "callable too large for utils::Function, capture less or raise Capacity");
+			static_assert(alignof(Callable) <= alignof(std::max_align_t), "callable over-aligned for utils::Function");
+
+			if (IsNull(f)) return;
+			new (&mStorage) Callable(std::forward<F>(f));
+			mOps = OpsFor<Callable>::Get();
+		}
+
+		void MoveFrom(Function& rh)
+		{
+			if (rh.mOps == nullptr) return;
+			rh.mOps->move(&mStorage, &rh.mStorage);
+			mOps = rh.mOps;
+			rh.mOps = nullptr;
+		}
+
+		void Reset()
+		{
+			if (mOps == nullptr) return;
+			mOps->destroy(&mStorage);
+			mOps = nullptr;
+		}
+
+		// empty function pointers and std::function stay empty
+		template<typename F>
+		static bool IsNull(const F& f) { return IsNullImpl(f, 0); }
+
+		template<typename F>
+		static auto IsNullImpl(const F& f, int) -> decltype(f == nullptr) { return f == nullptr; }
+
+		template<typename F>
+		static bool IsNullImpl(const F&, long) { return false; }
+
+	private:
+		typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type mStorage;
+		const Ops* mOps;
+	};
+
+	template<typename Signature, size_t Capacity>
+	inline bool operator==(const Function<Signature, Capacity>& f, std::nullptr_t) { return !f; }
+
+	template<typename Signature, size_t Capacity>
+	inline bool operator==(std::nullptr_t, const Function<Signature, Capacity>& f) { return !f; }
+
+	template<typename Signature, size_t Capacity>
+	inline bool operator!=(const Function<Signature, Capacity>& f, std::nullptr_t) { return !!f; }
+
+	template<typename Signature, size_t Capacity>
+	inline bool operator!=(std::nullptr_t, const Function<Signature, Capacity>& f) { return !!f; }
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef __UTILS_HISTOGRAM_HEADER__
+#define __UTILS_HISTOGRAM_HEADER__
+
+#include <utils/typedef.h>
+#include <atomic>
+
+namespace utils
+{
+	// log2 buckets: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i).
+	// one thread records, any thread may read. counters are relaxed, a read is not an exact snapshot
+	class Histogram
+	{
+	public:
+		enum { BUCKETS = 40 };
+
+		Histogram()
+		{
+			Reset();
+		}
+
+		void Record(uint64 value)
+		{
+			int index = BucketIndex(value);
+			Add(mBuckets[index], 1);
+			Add(mCount, 1);
+			Add(mSum, value);
+			if (value > mMax.load(std::memory_order_relaxed))
+				mMax.store(value, std::memory_order_relaxed);
+		}
+
+		uint64 Count() const { return mCount.load(std::memory_order_relaxed); }
+		uint64 Sum() const { return mSum.load(std::memory_order_relaxed); }
+		uint64 Max() const { return mMax.load(std::memory_order_relaxed); }
+
+		uint64 Mean() const
+		{
+			uint64 count = Count();
+			return count != 0 ? Sum() / count : 0;
+		}
+
+		uint64 Bucket(int index) const { return mBuckets[index].load(std::memory_order_relaxed); }
+
+		// upper bound of the bucket holding the given percentile (0-100)
+		uint64 Percentile(double percent) const
+		{
+			uint64 count = Count();
+			if (count == 0) return 0;
+
+			uint64 rank = uint64(count * percent / 100.0);
+			if (rank >= count) rank = count - 1;
+
+			uint64 seen = 0;
+			for (int i = 0; i < BUCKETS; ++i)
+			{
+				seen += Bucket(i);
+				if (seen > rank)
+				{
+					uint64 bound = i == 0 ? 0 : (uint64(1) << i) - 1;
+					return bound < Max() ? bound : Max();
+				}
+			}
+			return Max();
+		}
+
+		void Reset()
+		{
+			for (int i = 0; i < BUCKETS; ++i)
+				mBuckets[i].store(0, std::memory_order_relaxed);
+			mCount.store(0, std::memory_order_relaxed);
+			mSum.store(0, std::memory_order_relaxed);
+			mMax.store(0, std::memory_order_relaxed);
+		}
+
+	private:
+		Histogram(const Histogram&) = delete;
+		Histogram& operator=(const Histogram&) = delete;
+
+		// single writer: no locked instruction needed
+		static void Add(std::atomic<uint64>& counter, uint64 value)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		static int BucketIndex(uint64 value)
+		{
+			int index = 0;
+			while (value != 0 && index < BUCKETS - 1)
+			{
+				value >>= 1;
+				++index;
+			}
+			return index;
+		}
+
+	private:
+		std::atomic<uint64> mBuckets[BUCKETS];
+		std::atomic<uint64> mCount;
+		std::atomic<uint64> mSum;
+		std::atomic<uint64> mMax;
+	};
+}
+
+#endif
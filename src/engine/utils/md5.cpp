@@ -1,6 +1,7 @@
 #include "md5.h"
 #include <string>
 #include <fstream>
+#include <string.h>
 
 /* Type define */
 typedef unsigned char byte;
@@ -46,8 +47,6 @@ private:
 	static const size_t BUFFER_SIZE = 1024;
 };
 
-using namespace std;
-
 /* Constants for MD5Transform routine. */
 #define S11 7
 #define S12 12
@@ -0,0 +1,128 @@
+#ifndef __UTILS_MPMC_QUEUE_HEADER__
+#define __UTILS_MPMC_QUEUE_HEADER__
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace utils
+{
+	// bounded multi-producer multi-consumer ring (Vyukov).
+	// every cell carries a sequence number, Push() and Pop() claim a cell with one CAS and never wait.
+	// capacity is rounded up to a power of two
+	template<typename T>
+	class MPMCQueue
+	{
+	public:
+		explicit MPMCQueue(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size <<= 1;
+
+			mMask = size - 1;
+			mCells.reset(new Cell[size]);
+			for (size_t i = 0; i < size; ++i)
+				mCells[i].sequence.store(i, std::memory_order_relaxed);
+			mEnqueue.store(0, std::memory_order_relaxed);
+			mDequeue.store(0, std::memory_order_relaxed);
+		}
+
+		// false when full
+		bool Push(T value)
+		{
+			Cell* cell;
+			size_t pos = mEnqueue.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				cell = &mCells[pos & mMask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+				if (diff == 0)
+				{
+					if (mEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = mEnqueue.load(std::memory_order_relaxed);
+				}
+			}
+
+			cell->data = std::move(value);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// false when empty, or when the oldest push is not finished yet
+		bool Pop(T& value)
+		{
+			Cell* cell;
+			size_t pos = mDequeue.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				cell = &mCells[pos & mMask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+				if (diff == 0)
+				{
+					if (mDequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (diff < 0)
+				{
+					return false;
+				}
+				else
+				{
+					pos = mDequeue.load(std::memory_order_relaxed);
+				}
+			}
+
+			value = std::move(cell->data);
+			cell->sequence.store(pos + mMask + 1, std::memory_order_release);
+			return true;
+		}
+
+		// approximate while other threads push or pop
+		size_t Size() const
+		{
+			size_t enqueue = mEnqueue.load(std::memory_order_acquire);
+			size_t dequeue = mDequeue.load(std::memory_order_acquire);
+			return enqueue > dequeue ? enqueue - dequeue : 0;
+		}
+
+		bool Empty() const { return Size() == 0; }
+
+		size_t Capacity() const { return mMask + 1; }
+
+	private:
+		MPMCQueue(const MPMCQueue&) = delete;
+		MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			T data;
+		};
+
+		enum { CACHE_LINE = 64 };
+
+	private:
+		std::unique_ptr<Cell[]> mCells;
+		size_t mMask;
+		char mPad0[CACHE_LINE];
+		std::atomic<size_t> mEnqueue;
+		char mPad1[CACHE_LINE];
+		std::atomic<size_t> mDequeue;
+		char mPad2[CACHE_LINE];
+	};
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __UTILS_MPSC_QUEUE_HEADER__
+#define __UTILS_MPSC_QUEUE_HEADER__
+
+#include <atomic>
+
+namespace utils
+{
+	struct MPSCNode
+	{
+		std::atomic<MPSCNode*> next;
+	};
+
+	// intrusive multi-producer single-consumer queue (Vyukov).
+	// Push() is wait-free and may be called from any thread,
+	// Pop() and Empty() only from the consumer thread. nodes are owned by the caller.
+	class MPSCQueue
+	{
+	public:
+		MPSCQueue()
+			: mHead(&mStub)
+			, mTail(&mStub)
+		{
+			mStub.next.store(nullptr, std::memory_order_relaxed);
+		}
+
+		void Push(MPSCNode* node)
+		{
+			node->next.store(nullptr, std::memory_order_relaxed);
+			MPSCNode* prev = mHead.exchange(node);
+			prev->next.store(node, std::memory_order_release);
+		}
+
+		// nullptr when empty, or when the only remaining push is not finished yet
+		MPSCNode* Pop()
+		{
+			MPSCNode* tail = mTail;
+			MPSCNode* next = tail->next.load(std::memory_order_acquire);
+			if (tail == &mStub)
+			{
+				if (next == nullptr) return nullptr;
+				mTail = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+
+			if (next != nullptr)
+			{
+				mTail = next;
+				return tail;
+			}
+
+			if (tail != mHead.load()) return nullptr;
+
+			Push(&mStub);
+			next = tail->next.load(std::memory_order_acquire);
+			if (next != nullptr)
+			{
+				mTail = next;
+				return tail;
+			}
+			return nullptr;
+		}
+
+		// Pop() leaves the last node as mTail, so only the stub there means empty.
+		// mHead is checked too: a push in flight is not empty
+		bool Empty() const
+		{
+			return mTail == &mStub
+				&& mStub.next.load(std::memory_order_acquire) == nullptr
+				&& mHead.load() == &mStub;
+		}
+
+	private:
+		MPSCQueue(const MPSCQueue&) = delete;
+		MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	private:
+		std::atomic<MPSCNode*> mHead;
+		MPSCNode*              mTail;
+		MPSCNode               mStub;
+	};
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef __UTILS_NODE_POOL_HEADER__
+#define __UTILS_NODE_POOL_HEADER__
+
+#include <atomic>
+
+namespace utils
+{
+	// process wide free list of T, T must have a member `T* poolNext`.
+	// Free() pushes onto a shared lock-free stack, Alloc() takes the whole stack
+	// into a per-thread cache, so there is no ABA problem and no lock.
+	template<typename T>
+	class NodePool
+	{
+	public:
+		static T* Alloc()
+		{
+			LocalCache& cache = GetLocalCache();
+			if (cache.head == nullptr)
+				cache.head = GetShared().exchange(nullptr, std::memory_order_acquire);
+
+			T* node = cache.head;
+			if (node == nullptr)
+				return new T();
+
+			cache.head = node->poolNext;
+			return node;
+		}
+
+		static void Free(T* node)
+		{
+			Push(node, node);
+		}
+
+	private:
+		struct LocalCache
+		{
+			T* head;
+
+			LocalCache() : head(nullptr) {}
+
+			~LocalCache()
+			{
+				if (head == nullptr) return;
+				T* last = head;
+				while (last->poolNext != nullptr)
+					last = last->poolNext;
+				Push(head, last);
+			}
+		};
+
+		static void Push(T* first, T* last)
+		{
+			std::atomic<T*>& shared = GetShared();
+			T* top = shared.load(std::memory_order_relaxed);
+			do
+			{
+				last->poolNext = top;
+			} while (!shared.compare_exchange_weak(top, first, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		static std::atomic<T*>& GetShared()
+		{
+			static std::atomic<T*> shared(nullptr);
+			return shared;
+		}
+
+		static LocalCache& GetLocalCache()
+		{
+			static thread_local LocalCache cache;
+			return cache;
+		}
+	};
+}
+
+#endif
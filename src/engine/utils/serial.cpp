@@ -1,9 +1,16 @@
 #include "serial.h"
+#include "mpsc_queue.h"
+#include "node_pool.h"
+#include "timing_wheel.h"
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <thread>
-#include <map>
+#include <string.h>
 
 // _WIN32_WINNT version constants
 #define _WIN32_WINNT_NT4          0x0400 // Windows NT 4.0
@@ -30,22 +37,48 @@
 
 #include <asio.hpp>
 #include <asio/io_service.hpp>
-#include <asio/system_timer.hpp>
+#include <asio/steady_timer.hpp>
 
 using namespace asio;
 using namespace std::chrono;
 using namespace std::placeholders;
 
-struct TimerInfo
+struct PostNode : public utils::MPSCNode
 {
-	uint timerID;
-	system_clock::duration duration;
-	system_timer timer;
+	Serial::PostHandler handler;
+	Serial::PostTag tag;
+	int64 postTime; // microsec since Core::startTime, -1: not sampled
+	PostNode* poolNext;
 
-	TimerInfo(io_service& service) : timer(service) {}
+	PostNode() : tag(Serial::PostTag::Other), postTime(-1), poolNext(nullptr) {}
 };
 
-typedef std::shared_ptr<TimerInfo> TimerInfoPtr;
+typedef utils::NodePool<PostNode> PostNodePool;
+
+typedef utils::TimingWheel<Serial::TimerHandler> TimerWheel;
+
+// handlers run per drain before timers get a turn
+enum { DRAIN_BATCH = 256 };
+
+// tick mode: late ticks run back to back up to this many periods behind
+enum { TICK_CATCH_UP_LIMIT = 5 };
+
+enum { TAG_COUNT = (int)Serial::PostTag::Count };
+
+enum { PRIORITY_COUNT = (int)Serial::Priority::Count };
+
+enum { DEFAULT_STARVATION_LIMIT = 16 };
+
+static const char* const TAG_NAMES[TAG_COUNT] = { "other", "net recv", "db result", "timer" };
+
+// delay and run time of one in this many posted handlers are recorded, timers always
+enum { STATS_SAMPLE_INTERVAL = 16 };
+
+static bool SamplePost()
+{
+	static thread_local uint counter = 0;
+	return ++counter % STATS_SAMPLE_INTERVAL == 0;
+}
 
 struct Serial::Core
 {
@@ -56,43 +89,582 @@ struct Serial::Core
 	std::mutex mutex;
 
 	bool working;
-	uint timerIDCounter;
 
-	std::map<uint, TimerInfoPtr> timerInfos;
+	// posted handlers bypass the io_service queue, one queue per priority.
+	// one drain is posted to the io_service per batch
+	utils::MPSCQueue postQueues[PRIORITY_COUNT];
+	std::atomic<bool> drainScheduled;
+	uint skipped[PRIORITY_COUNT]; // times passed over, serial thread only
+	uint starvationLimit;
+
+	// all timers share one wheel driven by one asio timer, guarded by mutex
+	TimerWheel wheel;
+	steady_timer tickTimer;
+	steady_clock::time_point startTime;
+	steady_clock::duration resolution;
+	uint64 armedTick; // the tick the asio timer waits for, ~0: not armed
+
+	// virtual clock: time only moves in Advance(), guarded by mutex
+	bool virtualClock;
+	steady_clock::duration virtualNow;
+
+	// tick mode
+	bool tickMode;
+	std::atomic<bool> ticking;
+	TickParams tickParams;
+	TickStats tickStats;
+
+	// statistics, written by the serial thread only.
+	// queueDepth is raised per post and lowered per drained batch
+	std::atomic<uint> queueDepth;
+	utils::Histogram depthHistogram;
+	utils::Histogram delayHistogram[TAG_COUNT];
+	utils::Histogram runHistogram[TAG_COUNT];
+	utils::Histogram priorityDelayHistogram[PRIORITY_COUNT];
+
+	// the handler running now, read by the watchdog
+	std::atomic<bool> running;
+	std::atomic<int> runningTag;
+	std::atomic<uint64> runningSeq;
+
+	std::string name;
+	utils::CPUSet affinity;
+
+	uint stallThreshold;
+	std::thread watchdog;
+	std::mutex watchdogMutex;
+	std::condition_variable watchdogCond;
+	bool watchdogRunning;
+
+	Core()
+		: working(false)
+		, drainScheduled(false)
+		, starvationLimit(DEFAULT_STARVATION_LIMIT)
+		, tickTimer(service)
+		, startTime(steady_clock::now())
+		, resolution(milliseconds(1))
+		, armedTick(~uint64(0))
+		, virtualClock(false)
+		, virtualNow(steady_clock::duration::zero())
+		, tickMode(false)
+		, ticking(false)
+		, queueDepth(0)
+		, running(false)
+		, runningTag(0)
+		, runningSeq(0)
+		, name("serial")
+		, stallThreshold(0)
+		, watchdogRunning(false)
+	{
+		memset(&tickStats, 0, sizeof(tickStats));
+		memset(skipped, 0, sizeof(skipped));
+	}
+
+	~Core()
+	{
+		StopWatchdog();
+		for (int i = 0; i < PRIORITY_COUNT; ++i)
+		{
+			while (auto* node = static_cast<PostNode*>(postQueues[i].Pop()))
+				delete node;
+		}
+	}
+
+	// first thing on the serial thread, before anything is allocated there
+	void SetupThread()
+	{
+		utils::SetThreadAffinity(affinity);
+		utils::SetThreadName(name.c_str());
+	}
+
+	int64 NowMicro()
+	{
+		return (int64)duration_cast<microseconds>(steady_clock::now() - startTime).count();
+	}
+
+	// a marker for the watchdog, no clock read
+	void BeginHandler(PostTag tag)
+	{
+		runningTag.store((int)tag, std::memory_order_relaxed);
+		runningSeq.store(runningSeq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		running.store(true, std::memory_order_release);
+	}
+
+	void EndHandler()
+	{
+		running.store(false, std::memory_order_relaxed);
+	}
+
+	bool QueuesEmpty()
+	{
+		for (int i = 0; i < PRIORITY_COUNT; ++i)
+		{
+			if (!postQueues[i].Empty()) return false;
+		}
+		return true;
+	}
+
+	// the next handler by priority, a starving class goes first
+	PostNode* PopNode(int& priority)
+	{
+		for (int i = PRIORITY_COUNT - 1; i > 0; --i)
+		{
+			if (starvationLimit == 0 || skipped[i] < starvationLimit) continue;
+			skipped[i] = 0;
+			if (auto* node = static_cast<PostNode*>(postQueues[i].Pop()))
+			{
+				priority = i;
+				return node;
+			}
+		}
+
+		for (int i = 0; i < PRIORITY_COUNT; ++i)
+		{
+			auto* node = static_cast<PostNode*>(postQueues[i].Pop());
+			if (node == nullptr) continue;
+
+			// a lone handler left behind by a partial pop counts too
+			for (int j = i + 1; j < PRIORITY_COUNT; ++j)
+			{
+				if (!postQueues[j].Empty())
+					++skipped[j];
+			}
+			priority = i;
+			return node;
+		}
+		return nullptr;
+	}
+
+	void RunNode(PostNode* node, int priority)
+	{
+		PostHandler handler;
+		handler.swap(node->handler);
+		PostTag tag = node->tag;
+		int64 postTime = node->postTime;
+		PostNodePool::Free(node);
+
+		BeginHandler(tag);
+		if (postTime < 0)
+		{
+			handler();
+			EndHandler();
+			return;
+		}
+
+		// sampled
+		int64 begin = NowMicro();
+		uint64 delay = uint64(begin > postTime ? begin - postTime : 0);
+		delayHistogram[(int)tag].Record(delay);
+		priorityDelayHistogram[priority].Record(delay);
+		handler();
+		EndHandler();
+		runHistogram[(int)tag].Record(uint64(NowMicro() - begin));
+	}
+
+	void StartWatchdog()
+	{
+		if (stallThreshold == 0 || watchdog.joinable()) return;
+		watchdogRunning = true;
+		watchdog = std::thread([this]()
+		{
+			utils::SetThreadName((name + "-wd").c_str());
+			RunWatchdog();
+		});
+	}
+
+	void StopWatchdog()
+	{
+		if (!watchdog.joinable()) return;
+		{
+			std::lock_guard<std::mutex> guard(watchdogMutex);
+			watchdogRunning = false;
+		}
+		watchdogCond.notify_one();
+		watchdog.join();
+	}
+
+	// reports each stalled handler once. a handler is stalled when the same one
+	// is seen running for the threshold, accurate to a quarter of the threshold
+	void RunWatchdog()
+	{
+		const milliseconds interval(std::max(1u, stallThreshold / 4));
+		uint64 watchSeq = 0;
+		uint64 reportedSeq = 0;
+		steady_clock::time_point watchStart = steady_clock::now();
+
+		std::unique_lock<std::mutex> lock(watchdogMutex);
+		while (watchdogRunning)
+		{
+			watchdogCond.wait_for(lock, interval);
+
+			auto now = steady_clock::now();
+			bool busy = running.load(std::memory_order_acquire);
+			uint64 seq = runningSeq.load(std::memory_order_relaxed);
+			int tag = runningTag.load(std::memory_order_relaxed);
+			if (!busy || seq != watchSeq)
+			{
+				watchSeq = seq;
+				watchStart = now;
+				continue;
+			}
+			if (seq == reportedSeq) continue;
+
+			auto elapsed = duration_cast<milliseconds>(now - watchStart).count();
+			if (elapsed < stallThreshold) continue;
+
+			reportedSeq = seq;
+			LOG_WARN(nullptr, "serial stall: " << TAG_NAMES[tag] << " handler running for over " << elapsed << "ms");
+		}
+	}
+
+	// tick mode: the tick loop drains, producers never post to the io_service
+	void ScheduleDrain()
+	{
+		if (tickMode) return;
+		if (!drainScheduled.exchange(true))
+			service.post(std::bind(&Core::Drain, this));
+	}
+
+	void Drain()
+	{
+		// posted before SetTickMode(): dropped, so it can't run outside the event budget
+		if (tickMode) return;
+
+		depthHistogram.Record(queueDepth.load(std::memory_order_relaxed));
+
+		size_t count = 0;
+		int priority = 0;
+		while (count < DRAIN_BATCH)
+		{
+			auto* node = PopNode(priority);
+			if (node == nullptr) break;
+
+			++count;
+			RunNode(node, priority);
+		}
+		queueDepth.fetch_sub((uint)count, std::memory_order_relaxed);
+
+		if (count == DRAIN_BATCH)
+		{
+			service.post(std::bind(&Core::Drain, this));
+			return;
+		}
+
+		// a producer that saw drainScheduled set before this store relies on the check below
+		drainScheduled.store(false);
+		if (!QueuesEmpty())
+			ScheduleDrain();
+	}
+
+	// runs posted handlers until the queue is empty or the deadline passes,
+	// returns false when handlers are left for later
+	bool DrainUntil(const steady_clock::time_point& deadline)
+	{
+		depthHistogram.Record(queueDepth.load(std::memory_order_relaxed));
+
+		size_t count = 0;
+		int priority = 0;
+		bool drained = true;
+		for (;;)
+		{
+			auto* node = PopNode(priority);
+			if (node == nullptr) break;
+
+			++count;
+			RunNode(node, priority);
+
+			if (steady_clock::now() >= deadline)
+			{
+				drained = QueuesEmpty();
+				break;
+			}
+		}
+		queueDepth.fetch_sub((uint)count, std::memory_order_relaxed);
+		return drained;
+	}
+
+	// fixed-rate loop: posted handlers up to the budget, timers, then the update phase
+	void RunTicks()
+	{
+		const steady_clock::duration period = microseconds(1000000 / tickParams.rate);
+		const steady_clock::duration budget = tickParams.eventBudget != 0
+			? steady_clock::duration(milliseconds(tickParams.eventBudget))
+			: steady_clock::duration::max() / 2;
+
+		uint64 tick = 0;
+		auto next = steady_clock::now();
+		while (ticking.load())
+		{
+			auto begin = steady_clock::now();
+
+			bool drained = DrainUntil(begin + budget);
+			service.poll();
+			if (tickParams.handler)
+				tickParams.handler(tick);
+
+			auto end = steady_clock::now();
+			next += period;
+
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				uint cost = (uint)duration_cast<microseconds>(end - begin).count();
+				++tickStats.ticks;
+				tickStats.lastTickTime = cost;
+				if (cost > tickStats.maxTickTime) tickStats.maxTickTime = cost;
+				if (!drained) ++tickStats.deferredTicks;
+				if (end > next)
+				{
+					uint overrun = (uint)duration_cast<microseconds>(end - next).count();
+					++tickStats.overruns;
+					if (overrun > tickStats.maxOverrun) tickStats.maxOverrun = overrun;
+				}
+
+				// far behind: give up the missed ticks instead of running them back to back
+				if (end > next + period * TICK_CATCH_UP_LIMIT)
+				{
+					tickStats.skippedTicks += uint64((end - next) / period);
+					next = end;
+				}
+			}
+
+			++tick;
+			std::this_thread::sleep_until(next);
+		}
+	}
+
+	// time since start, virtual or real
+	steady_clock::duration Elapsed()
+	{
+		return virtualClock ? virtualNow : steady_clock::now() - startTime;
+	}
+
+	uint64 CurrentTick()
+	{
+		return uint64(Elapsed() / resolution);
+	}
+
+	// rounded up, at least one tick
+	uint64 ToTicks(const steady_clock::duration& duration)
+	{
+		if (duration <= steady_clock::duration::zero()) return 1;
+		return uint64((duration + resolution - steady_clock::duration(1)) / resolution);
+	}
+
+	// mutex must be held
+	uint AddTimer(const steady_clock::duration& duration, TimerHandler&& handler, bool repeat)
+	{
+		// never fires before now + duration
+		uint64 expire = ToTicks(Elapsed() + duration);
+		uint timerID = wheel.Add(expire, repeat ? ToTicks(duration) : 0, std::move(handler));
+		if (timerID != 0 && expire < armedTick && !virtualClock)
+		{
+			// due before the armed tick, the asio timer is set again on the serial thread
+			armedTick = expire;
+			service.post(std::bind(&Core::ArmTick, this));
+		}
+		return timerID;
+	}
+
+	void ArmTick()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		SetTickTimer();
+	}
+
+	// mutex must be held. the asio timer waits for the next tick the wheel has work for,
+	// an idle wheel doesn't wake the thread every tick
+	void SetTickTimer()
+	{
+		if (wheel.Empty())
+		{
+			armedTick = ~uint64(0);
+			return;
+		}
+
+		armedTick = wheel.NextTick();
+		tickTimer.expires_at(startTime + resolution * armedTick);
+		tickTimer.async_wait(std::bind(&Core::OnTick, this, _1));
+	}
+
+	// runs timers due up to tick `now`, the lock is released while a handler runs
+	void RunTimers(std::unique_lock<std::mutex>& lock, uint64 now)
+	{
+		while (auto* node = wheel.Expire(now))
+		{
+			int64 due = (int64)duration_cast<microseconds>(resolution * node->expire).count();
+			lock.unlock();
+			int64 begin = NowMicro();
+			if (!virtualClock)
+				delayHistogram[(int)PostTag::Timer].Record(uint64(begin > due ? begin - due : 0));
+			BeginHandler(PostTag::Timer);
+			node->handler(node->id);
+			EndHandler();
+			runHistogram[(int)PostTag::Timer].Record(uint64(NowMicro() - begin));
+			lock.lock();
+			wheel.Finish(node);
+		}
+	}
+
+	// virtual clock: runs the io_service on the calling thread until nothing is posted
+	void RunUntilIdle()
+	{
+		for (;;)
+		{
+			if (service.stopped())
+				service.reset();
+			if (service.poll() == 0 && QueuesEmpty()) break;
+		}
+	}
+
+	// virtual clock: one tick at a time, so what a timer posts runs before the next tick's timers
+	void Advance(const steady_clock::duration& duration)
+	{
+		RunUntilIdle();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		steady_clock::duration target = virtualNow + duration;
+		uint64 last = uint64(target / resolution);
+		for (uint64 tick = wheel.Now(); tick <= last && !wheel.Empty(); ++tick)
+		{
+			virtualNow = std::max(virtualNow, steady_clock::duration(resolution * int64(tick)));
+			RunTimers(lock, tick);
+			lock.unlock();
+			RunUntilIdle();
+			lock.lock();
+		}
+		virtualNow = std::max(virtualNow, target);
+	}
+
+	void OnTick(const asio::error_code& err)
+	{
+		if (err) return; // already cancel
 
-	Core() : working(false), timerIDCounter(0) {}
+		uint64 now = CurrentTick();
+		std::unique_lock<std::mutex> lock(mutex);
+		RunTimers(lock, now);
+		SetTickTimer();
+	}
 };
 
-static void _TimerHandler(TimerInfoPtr timerInfo, const Serial::TimerHandler& handler, const asio::error_code& err)
+Serial::Serial()
+	: mCore(new Core())
 {
-	if (err) return; // already cancel
-	handler(timerInfo->timerID);
-	auto t = timerInfo->timer.expires_at() + timerInfo->duration;
-	timerInfo->timer.expires_at(t);
-	timerInfo->timer.async_wait(std::bind(_TimerHandler, timerInfo, handler, _1));
 }
 
-static void _ExpireHandler(TimerInfoPtr timerInfo, const Serial::TimerHandler& handler, Serial* serial, const asio::error_code& err)
+Serial::~Serial()
 {
-	if (err) return; // already cancel
-	handler(timerInfo->timerID);
-	serial->RemoveTimer(timerInfo->timerID);
 }
 
-Serial::Serial()
-	: mCore(new Core())
+void Serial::SetTimerResolution(uint millisec)
 {
+	if (mCore->working || millisec == 0) return;
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	if (!mCore->wheel.Empty()) return;
+	mCore->resolution = milliseconds(millisec);
 }
 
-Serial::~Serial()
+uint Serial::GetTimerResolution()
+{
+	return (uint)duration_cast<milliseconds>(mCore->resolution).count();
+}
+
+void Serial::SetTickMode(const TickParams& params)
+{
+	if (mCore->working || params.rate == 0) return;
+	mCore->tickMode = true;
+	mCore->tickParams = params;
+}
+
+Serial::TickStats Serial::GetTickStats()
+{
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	return mCore->tickStats;
+}
+
+uint Serial::GetQueueDepth()
+{
+	return mCore->queueDepth.load(std::memory_order_relaxed);
+}
+
+const utils::Histogram& Serial::GetQueueDepthHistogram()
+{
+	return mCore->depthHistogram;
+}
+
+const utils::Histogram& Serial::GetDelayHistogram(PostTag tag)
+{
+	return mCore->delayHistogram[(int)tag % TAG_COUNT];
+}
+
+const utils::Histogram& Serial::GetRunTimeHistogram(PostTag tag)
+{
+	return mCore->runHistogram[(int)tag % TAG_COUNT];
+}
+
+const utils::Histogram& Serial::GetDelayHistogram(Priority priority)
+{
+	return mCore->priorityDelayHistogram[(int)priority % PRIORITY_COUNT];
+}
+
+void Serial::SetStarvationLimit(uint val)
+{
+	if (mCore->working) return;
+	mCore->starvationLimit = val;
+}
+
+uint Serial::GetStarvationLimit()
 {
+	return mCore->starvationLimit;
+}
+
+void Serial::ResetStats()
+{
+	mCore->depthHistogram.Reset();
+	for (int i = 0; i < TAG_COUNT; ++i)
+	{
+		mCore->delayHistogram[i].Reset();
+		mCore->runHistogram[i].Reset();
+	}
+	for (int i = 0; i < PRIORITY_COUNT; ++i)
+		mCore->priorityDelayHistogram[i].Reset();
+}
+
+void Serial::SetStallThreshold(uint millisec)
+{
+	if (mCore->working) return;
+	mCore->stallThreshold = millisec;
+}
+
+uint Serial::GetStallThreshold()
+{
+	return mCore->stallThreshold;
+}
+
+void Serial::SetName(const std::string& name)
+{
+	if (mCore->working) return;
+	mCore->name = name;
+}
+
+void Serial::SetAffinity(const utils::CPUSet& cpus)
+{
+	if (mCore->working) return;
+	mCore->affinity = cpus;
 }
 
 void Serial::Start()
 {
 	mCore->working = true;
 	mCore->serviceWork.reset(new io_service::work(mCore->service));
-	mCore->thread.swap(std::thread([&]() { mCore->service.run(); }));
+	if (mCore->virtualClock) return;
+	mCore->StartWatchdog();
+	if (mCore->tickMode)
+	{
+		mCore->ticking = true;
+		mCore->thread = std::thread([&]() { mCore->SetupThread(); mCore->RunTicks(); });
+		return;
+	}
+	mCore->thread.swap(std::thread([&]() { mCore->SetupThread(); mCore->service.run(); }));
 }
 
 void Serial::Stop()
@@ -100,77 +672,82 @@ void Serial::Stop()
 	{
 		std::lock_guard<std::mutex> guard(mCore->mutex);
 		mCore->working = false;
-		for (auto& kv : mCore->timerInfos)
-		{
-			kv.second->timer.cancel();
-		}
 	}
+	mCore->ticking = false;
 	mCore->serviceWork.reset();
 	mCore->service.stop();
 	if (mCore->thread.joinable())
 		mCore->thread.join();
+	mCore->StopWatchdog();
 }
 
-void Serial::Post(const PostHandler& handler)
+void Serial::SetVirtualClock(bool val)
 {
-	if (handler == nullptr) return;
-	mCore->service.post(handler);
+	if (mCore->working) return;
+	mCore->virtualClock = val;
 }
 
-uint Serial::AddTimer(const std::chrono::system_clock::duration& duration, const TimerHandler& handler)
+bool Serial::IsVirtualClock()
 {
-	if (handler == nullptr) return 0;
+	return mCore->virtualClock;
+}
 
-	auto eventTime = system_clock::now() + duration;
+void Serial::RunUntilIdle()
+{
+	if (!mCore->virtualClock || !mCore->working) return;
+	mCore->RunUntilIdle();
+}
 
-	TimerInfoPtr timerInfo(new TimerInfo(mCore->service));
-	timerInfo->duration = duration;
+void Serial::Advance(const std::chrono::steady_clock::duration& duration)
+{
+	if (!mCore->virtualClock || !mCore->working) return;
+	mCore->Advance(duration);
+}
 
-	{
-		std::lock_guard<std::mutex> guard(mCore->mutex);
-		timerInfo->timerID = ++mCore->timerIDCounter;
-		mCore->timerInfos[timerInfo->timerID] = timerInfo;
-	}
+std::chrono::steady_clock::duration Serial::Now()
+{
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	return mCore->Elapsed();
+}
+
+void Serial::Post(PostHandler handler, PostTag tag, Priority priority)
+{
+	if (handler == nullptr) return;
 
-	timerInfo->timer.expires_at(eventTime);
-	timerInfo->timer.async_wait(std::bind(_TimerHandler, timerInfo, handler, _1));
-	return timerInfo->timerID;
+	PostNode* node = PostNodePool::Alloc();
+	node->handler = std::move(handler);
+	node->tag = tag;
+	node->postTime = SamplePost() ? mCore->NowMicro() : -1;
+	mCore->queueDepth.fetch_add(1, std::memory_order_relaxed);
+	mCore->postQueues[(int)priority % PRIORITY_COUNT].Push(node);
+	mCore->ScheduleDrain();
 }
 
-uint Serial::Expire(const std::chrono::system_clock::duration& duration, const TimerHandler& handler)
+uint Serial::AddTimer(const std::chrono::steady_clock::duration& duration, TimerHandler handler)
 {
 	if (handler == nullptr) return 0;
 
-	TimerInfoPtr timerInfo(new TimerInfo(mCore->service));
-	timerInfo->duration = duration;
-	timerInfo->timer.expires_from_now(duration);
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	return mCore->AddTimer(duration, std::move(handler), true);
+}
 
-	{
-		std::lock_guard<std::mutex> guard(mCore->mutex);
-		timerInfo->timerID = ++mCore->timerIDCounter;
-		mCore->timerInfos[timerInfo->timerID] = timerInfo;
-	}
+uint Serial::Expire(const std::chrono::steady_clock::duration& duration, TimerHandler handler)
+{
+	if (handler == nullptr) return 0;
 
-	timerInfo->timer.async_wait(std::bind(_ExpireHandler, timerInfo, handler, this, _1));
-	return timerInfo->timerID;
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	return mCore->AddTimer(duration, std::move(handler), false);
 }
 
-uint Serial::ExpireAt(const std::chrono::system_clock::time_point& time, const TimerHandler& handler)
+uint Serial::ExpireAt(const std::chrono::system_clock::time_point& time, TimerHandler handler)
 {
 	auto now = system_clock::now();
 	if (time < now) return 0;
-	return Expire(time - now, handler);
+	return Expire(duration_cast<steady_clock::duration>(time - now), std::move(handler));
 }
 
-void Serial::RemoveTimer(uint index)
+void Serial::RemoveTimer(uint timerID)
 {
-	TimerInfoPtr timerInfo;
-	{
-		std::lock_guard<std::mutex> guard(mCore->mutex);
-		auto iter = mCore->timerInfos.find(index);
-		if (iter == mCore->timerInfos.end()) return;
-		timerInfo = iter->second;
-		mCore->timerInfos.erase(iter);
-	}
-	timerInfo->timer.cancel();
+	std::lock_guard<std::mutex> guard(mCore->mutex);
+	mCore->wheel.Cancel(timerID);
 }
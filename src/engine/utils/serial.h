@@ -2,35 +2,148 @@
 #define __UTILS_SERIAL_HEADER_FILE__
 
 #include <utils/typedef.h>
+#include <utils/function.h>
+#include <utils/histogram.h>
+#include <utils/system.h>
 #include <functional>
 #include <memory>
 #include <chrono>
+#include <string>
 
 class Serial
 {
 public:
-	typedef std::function<void(uint)> TimerHandler;
-	typedef std::function<void(void)> PostHandler;
+	// move-only, captures up to 64 bytes are stored without allocation
+	typedef utils::Function<void(uint)> TimerHandler;
+	typedef utils::Function<void(void)> PostHandler;
+	typedef std::function<void(uint64)> TickHandler;
+
+	// source of a handler, for the event loop statistics
+	enum class PostTag
+	{
+		Other,
+		NetRecv,
+		DBResult,
+		Timer,
+		Count,
+	};
+
+	// posted handlers run by class: the highest non-empty one first,
+	// unless a lower one has been passed over SetStarvationLimit() times
+	enum class Priority
+	{
+		Critical, // connection events, network input
+		Normal,
+		Bulk,     // batch query chunks
+		Count,
+	};
+
+	struct TickParams
+	{
+		uint        rate;        // ticks per second
+		uint        eventBudget; // millisec for posted handlers before each update, 0: unlimited
+		TickHandler handler;     // update phase, called with the tick number
+
+		TickParams() : rate(20), eventBudget(0) {}
+	};
+
+	struct TickStats
+	{
+		uint64 ticks;
+		uint64 overruns;      // ticks finished after the next one was due
+		uint64 skippedTicks;  // given up when too far behind
+		uint64 deferredTicks; // ticks that left posted handlers for the next tick
+		uint   lastTickTime;  // microsec
+		uint   maxTickTime;   // microsec
+		uint   maxOverrun;    // microsec
+	};
 
 	Serial();
 
 	~Serial();
 
+	// before Start(): run a fixed-rate loop instead of waiting for events.
+	// each tick drains posted handlers up to the budget, runs due timers, then the update phase
+	void SetTickMode(const TickParams& params);
+
+	TickStats GetTickStats();
+
+	// before Start(): thread name shown by profilers ("serial" by default) and cpus to run on.
+	// pinning next to the io threads keeps their shared data on one numa node
+	void SetName(const std::string& name);
+
+	void SetAffinity(const utils::CPUSet& cpus);
+
+	// before Start(): time only moves when Advance() is called, for simulations and soak tests.
+	// no thread is started, the caller runs the serial with RunUntilIdle() and Advance().
+	// tick mode and the stall watchdog are not used, timers fire in a fixed order
+	void SetVirtualClock(bool val);
+
+	bool IsVirtualClock();
+
 	void Start();
 
 	void Stop();
 
-	void Post(const PostHandler& handler);
+	// virtual clock: runs posted handlers on the calling thread until none is left
+	void RunUntilIdle();
+
+	// virtual clock: moves time forward tick by tick, running due timers and what they post
+	void Advance(const std::chrono::steady_clock::duration& duration);
+
+	void Advance(uint millisec) { Advance(std::chrono::milliseconds(millisec)); }
+
+	// time since Start(), virtual or real
+	std::chrono::steady_clock::duration Now();
+
+	void Post(PostHandler handler, PostTag tag = PostTag::Other, Priority priority = Priority::Normal);
+
+	void Post(PostHandler handler, Priority priority) { Post(std::move(handler), PostTag::Other, priority); }
+
+	// default 16, 0: strict priority
+	void SetStarvationLimit(uint val);
+
+	uint GetStarvationLimit();
+
+	// event loop statistics, always recorded.
+	// delay and run time are sampled from one in 16 posted handlers and every timer.
+	// handlers waiting to run
+	uint GetQueueDepth();
+
+	// queue depth, sampled once per drained batch
+	const utils::Histogram& GetQueueDepthHistogram();
+
+	// microsec from post (or due time for timers) to start
+	const utils::Histogram& GetDelayHistogram(PostTag tag);
+
+	// microsec
+	const utils::Histogram& GetRunTimeHistogram(PostTag tag);
+
+	// microsec from post to start, per class
+	const utils::Histogram& GetDelayHistogram(Priority priority);
+
+	void ResetStats();
+
+	// a watchdog thread logs the tag of any handler running longer than this, 0: off (default)
+	void SetStallThreshold(uint millisec);
+
+	uint GetStallThreshold();
+
+	// timers are kept in a timing wheel on the monotonic clock,
+	// durations are rounded up to the timer resolution (1ms by default)
+	void SetTimerResolution(uint millisec);
+
+	uint GetTimerResolution();
 
-	uint AddTimer(const std::chrono::system_clock::duration& duration, const TimerHandler& handler);
+	uint AddTimer(const std::chrono::steady_clock::duration& duration, TimerHandler handler);
 
-	uint AddTimer(uint millisec, const TimerHandler& handler) { return AddTimer(std::chrono::milliseconds(millisec), handler); }
+	uint AddTimer(uint millisec, TimerHandler handler) { return AddTimer(std::chrono::milliseconds(millisec), std::move(handler)); }
 
-	uint Expire(const std::chrono::system_clock::duration& duration, const TimerHandler& handler);
+	uint Expire(const std::chrono::steady_clock::duration& duration, TimerHandler handler);
 
-	uint Expire(uint millisec, const TimerHandler& handler) { return Expire(std::chrono::milliseconds(millisec), handler); }
+	uint Expire(uint millisec, TimerHandler handler) { return Expire(std::chrono::milliseconds(millisec), std::move(handler)); }
 
-	uint ExpireAt(const std::chrono::system_clock::time_point& time, const TimerHandler& handler);
+	uint ExpireAt(const std::chrono::system_clock::time_point& time, TimerHandler handler);
 
 	void RemoveTimer(uint timerID);
 
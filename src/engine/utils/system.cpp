@@ -1,11 +1,18 @@
 #include <utils/system.h>
 #include <utils/platform.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
 #ifdef PLATFORM_WIN32
 #include <windows.h>
 #include <process.h>
 #elif defined(PLATFORM_LINUX)
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #endif
 
 namespace utils
@@ -35,4 +42,149 @@ namespace utils
 #endif
 	}
 
+#if defined(PLATFORM_LINUX)
+	// "0-3,8-11"
+	static CPUSet ParseCPUList(const char* list)
+	{
+		CPUSet cpus;
+		const char* p = list;
+		while (*p != '\0' && *p != '\n')
+		{
+			char* end = nullptr;
+			ulong first = strtoul(p, &end, 10);
+			if (end == p) break;
+			ulong last = first;
+			p = end;
+			if (*p == '-')
+			{
+				last = strtoul(p + 1, &end, 10);
+				p = end;
+			}
+			for (ulong cpu = first; cpu <= last; ++cpu)
+				cpus.push_back((uint)cpu);
+			if (*p == ',') ++p;
+		}
+		return cpus;
+	}
+
+	static bool ReadSysFile(const char* path, char* buf, size_t size)
+	{
+		FILE* fp = fopen(path, "r");
+		if (fp == nullptr) return false;
+		size_t len = fread(buf, 1, size - 1, fp);
+		fclose(fp);
+		buf[len] = '\0';
+		return len != 0;
+	}
+#endif
+
+	bool SetThreadAffinity(const CPUSet& cpus)
+	{
+		if (cpus.empty()) return true;
+#if defined(PLATFORM_WIN32)
+		DWORD_PTR mask = 0;
+		for (size_t i = 0; i < cpus.size(); ++i)
+		{
+			if (cpus[i] < sizeof(DWORD_PTR) * 8)
+				mask |= DWORD_PTR(1) << cpus[i];
+		}
+		return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (size_t i = 0; i < cpus.size(); ++i)
+		{
+			if (cpus[i] < CPU_SETSIZE)
+				CPU_SET(cpus[i], &set);
+		}
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+	}
+
+	void SetThreadName(const char* name)
+	{
+		if (name == nullptr) return;
+#if defined(PLATFORM_WIN32)
+		// SetThreadDescription is windows 10 1607+, looked up at runtime
+		typedef HRESULT (WINAPI *SetThreadDescriptionFunc)(HANDLE, PCWSTR);
+		static SetThreadDescriptionFunc func = (SetThreadDescriptionFunc)GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription");
+		if (func == nullptr) return;
+
+		wchar_t wname[64];
+		if (MultiByteToWideChar(CP_UTF8, 0, name, -1, wname, 64) == 0) return;
+		func(GetCurrentThread(), wname);
+#else
+		char buf[16];
+		strncpy(buf, name, sizeof(buf) - 1);
+		buf[sizeof(buf) - 1] = '\0';
+		pthread_setname_np(pthread_self(), buf);
+#endif
+	}
+
+	uint GetNodeNum()
+	{
+#if defined(PLATFORM_WIN32)
+		ULONG highest = 0;
+		if (!GetNumaHighestNodeNumber(&highest)) return 1;
+		return (uint)highest + 1;
+#else
+		char buf[256];
+		if (!ReadSysFile("/sys/devices/system/node/possible", buf, sizeof(buf))) return 1;
+		CPUSet nodes = ParseCPUList(buf);
+		return nodes.empty() ? 1 : nodes.back() + 1;
+#endif
+	}
+
+	int GetCPUNode(uint cpu)
+	{
+#if defined(PLATFORM_WIN32)
+		UCHAR node = 0;
+		if (cpu > 0xff || !GetNumaProcessorNode((UCHAR)cpu, &node) || node == 0xff) return 0;
+		return (int)node;
+#else
+		uint count = GetNodeNum();
+		for (uint node = 0; node < count; ++node)
+		{
+			CPUSet cpus = GetNodeCPUs((int)node);
+			for (size_t i = 0; i < cpus.size(); ++i)
+			{
+				if (cpus[i] == cpu) return (int)node;
+			}
+		}
+		return 0;
+#endif
+	}
+
+	CPUSet GetNodeCPUs(int node)
+	{
+		CPUSet cpus;
+		if (node < 0) return cpus;
+#if defined(PLATFORM_WIN32)
+		ULONGLONG mask = 0;
+		if (node > 0xff || !GetNumaNodeProcessorMask((UCHAR)node, &mask)) return cpus;
+		for (uint cpu = 0; cpu < 64; ++cpu)
+		{
+			if ((mask & (ULONGLONG(1) << cpu)) != 0)
+				cpus.push_back(cpu);
+		}
+#else
+		char path[128];
+		char buf[1024];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (ReadSysFile(path, buf, sizeof(buf)))
+			cpus = ParseCPUList(buf);
+#endif
+		return cpus;
+	}
+
+	int GetCurrentNode()
+	{
+#if defined(PLATFORM_WIN32)
+		return GetCPUNode((uint)GetCurrentProcessorNumber());
+#else
+		int cpu = sched_getcpu();
+		return cpu < 0 ? 0 : GetCPUNode((uint)cpu);
+#endif
+	}
+
 }
@@ -2,6 +2,7 @@
 #define __UTILS_SYSTEM_INFO_HEADER__
 
 #include <utils/typedef.h>
+#include <vector>
 
 namespace utils
 {
@@ -10,6 +11,26 @@ namespace utils
 
 	// ȡǰid
 	int GetPid();
+
+	typedef std::vector<uint> CPUSet;
+
+	// binds the calling thread to the cpus, empty: no change
+	bool SetThreadAffinity(const CPUSet& cpus);
+
+	// name of the calling thread for debuggers and profilers, linux keeps 15 chars
+	void SetThreadName(const char* name);
+
+	// number of numa nodes, 1 when unknown
+	uint GetNodeNum();
+
+	// numa node of a cpu, 0 when unknown
+	int GetCPUNode(uint cpu);
+
+	// cpus of a numa node, empty when unknown
+	CPUSet GetNodeCPUs(int node);
+
+	// numa node the calling thread is running on, 0 when unknown
+	int GetCurrentNode();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,191 @@
+#ifndef __UTILS_TASK_HEADER__
+#define __UTILS_TASK_HEADER__
+
+// coroutine support, needs C++20 (cmake -DENGINE_CXX20=ON)
+#if !(__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+# error "utils/task.h requires C++20 coroutines"
+#endif
+
+#include <utils/typedef.h>
+#include <utils/serial.h>
+#include <utils/frame_pool.h>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace utils
+{
+	template<typename T = void> class Task;
+
+	namespace detail
+	{
+		struct TaskPromiseBase
+		{
+			std::coroutine_handle<> continuation;
+			std::exception_ptr      exception;
+			bool                    detached = false;
+
+			struct FinalAwaiter
+			{
+				bool await_ready() noexcept { return false; }
+
+				template<typename Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+				{
+					auto& promise = h.promise();
+					if (promise.detached)
+					{
+						if (promise.exception)
+							std::terminate(); // nobody left to rethrow to
+						h.destroy();
+						return std::noop_coroutine();
+					}
+					if (promise.continuation)
+						return promise.continuation;
+					return std::noop_coroutine();
+				}
+
+				void await_resume() noexcept {}
+			};
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			FinalAwaiter final_suspend() noexcept { return {}; }
+			void unhandled_exception() { exception = std::current_exception(); }
+
+			static void* operator new(size_t size) { return FramePool::Alloc(size); }
+			static void operator delete(void* p, size_t size) { FramePool::Free(p, size); }
+		};
+
+		template<typename T>
+		struct TaskPromise : public TaskPromiseBase
+		{
+			std::optional<T> value;
+
+			Task<T> get_return_object();
+
+			template<typename U>
+			void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+			T result()
+			{
+				if (exception) std::rethrow_exception(exception);
+				return std::move(*value);
+			}
+		};
+
+		template<>
+		struct TaskPromise<void> : public TaskPromiseBase
+		{
+			Task<void> get_return_object();
+
+			void return_void() {}
+
+			void result()
+			{
+				if (exception) std::rethrow_exception(exception);
+			}
+		};
+	}
+
+	// lazy coroutine, frames come from FramePool.
+	// co_await it from another Task, or Detach() it to run on its own:
+	//   utils::Task<> LoadPlayer(uint id) { ... co_await utils::Sleep(serial, 100); ... }
+	//   LoadPlayer(id).Detach();
+	template<typename T>
+	class Task
+	{
+	public:
+		typedef detail::TaskPromise<T> promise_type;
+		typedef std::coroutine_handle<promise_type> Handle;
+
+		Task() {}
+		explicit Task(Handle handle) : mHandle(handle) {}
+		Task(Task&& rh) noexcept : mHandle(rh.mHandle) { rh.mHandle = nullptr; }
+
+		Task& operator=(Task&& rh) noexcept
+		{
+			if (this != &rh)
+			{
+				if (mHandle) mHandle.destroy();
+				mHandle = rh.mHandle;
+				rh.mHandle = nullptr;
+			}
+			return *this;
+		}
+
+		~Task()
+		{
+			if (mHandle) mHandle.destroy();
+		}
+
+		bool await_ready() const noexcept { return !mHandle || mHandle.done(); }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+		{
+			mHandle.promise().continuation = caller;
+			return mHandle;
+		}
+
+		T await_resume() { return mHandle.promise().result(); }
+
+		// starts the task on the calling thread, the frame is released when it finishes
+		void Detach()
+		{
+			Handle handle = mHandle;
+			mHandle = nullptr;
+			if (!handle) return;
+			handle.promise().detached = true;
+			handle.resume();
+		}
+
+	private:
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+	private:
+		Handle mHandle;
+	};
+
+	template<typename T>
+	inline Task<T> detail::TaskPromise<T>::get_return_object()
+	{
+		return Task<T>(std::coroutine_handle<TaskPromise<T> >::from_promise(*this));
+	}
+
+	inline Task<void> detail::TaskPromise<void>::get_return_object()
+	{
+		return Task<void>(std::coroutine_handle<TaskPromise<void> >::from_promise(*this));
+	}
+
+	// co_await SwitchTo(serial): continues on the serial thread
+	class SwitchTo
+	{
+	public:
+		explicit SwitchTo(Serial& serial) : mSerial(serial) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { mSerial.Post([h]() { h.resume(); }); }
+		void await_resume() noexcept {}
+
+	private:
+		Serial& mSerial;
+	};
+
+	// co_await Sleep(serial, 100): continues on the serial thread after the delay
+	class Sleep
+	{
+	public:
+		Sleep(Serial& serial, uint millisec) : mSerial(serial), mMillisec(millisec) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { mSerial.Expire(mMillisec, [h](uint) { h.resume(); }); }
+		void await_resume() noexcept {}
+
+	private:
+		Serial& mSerial;
+		uint    mMillisec;
+	};
+}
+
+#endif
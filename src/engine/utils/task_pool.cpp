@@ -0,0 +1,302 @@
+#include "task_pool.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace utils;
+
+struct TaskPool::Core
+{
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	std::vector<std::unique_ptr<Queue> > queues;
+	std::vector<std::thread> threads;
+
+	std::atomic<bool>   running;
+	std::atomic<size_t> pending;  // queued, not taken yet
+	std::atomic<uint>   sleeping;
+	std::atomic<uint>   next;     // round robin for outside posts
+	std::atomic<uint>   posting;  // Post() calls between checking running and pushing
+
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+
+	CPUSet affinity;
+
+	Core()
+		: running(false)
+		, pending(0)
+		, sleeping(0)
+		, next(0)
+		, posting(0) {}
+
+	void Push(const Job& job);
+	bool Pop(Job& job);
+	void Run(size_t index);
+};
+
+// pool and deque of the current thread, set on pool threads only
+static thread_local void* tlsPool = nullptr;
+static thread_local size_t tlsIndex = 0;
+
+void TaskPool::Core::Push(const Job& job)
+{
+	size_t index = tlsPool == this ? tlsIndex : next.fetch_add(1) % queues.size();
+	{
+		std::lock_guard<std::mutex> guard(queues[index]->mutex);
+		queues[index]->jobs.push_back(job);
+	}
+
+	// a thread about to sleep checks pending under sleepMutex
+	pending.fetch_add(1);
+	if (sleeping.load() != 0)
+	{
+		std::lock_guard<std::mutex> guard(sleepMutex);
+		wake.notify_one();
+	}
+}
+
+bool TaskPool::Core::Pop(Job& job)
+{
+	if (pending.load() == 0) return false;
+
+	size_t count = queues.size();
+	size_t self = tlsPool == this ? tlsIndex : next.load() % count;
+
+	// own deque from the back
+	if (tlsPool == this)
+	{
+		Queue& queue = *queues[self];
+		std::lock_guard<std::mutex> guard(queue.mutex);
+		if (!queue.jobs.empty())
+		{
+			job.swap(queue.jobs.back());
+			queue.jobs.pop_back();
+			pending.fetch_sub(1);
+			return true;
+		}
+	}
+
+	// steal from the front of the others
+	for (size_t i = 0; i < count; ++i)
+	{
+		Queue& queue = *queues[(self + i) % count];
+		std::lock_guard<std::mutex> guard(queue.mutex);
+		if (!queue.jobs.empty())
+		{
+			job.swap(queue.jobs.front());
+			queue.jobs.pop_front();
+			pending.fetch_sub(1);
+			return true;
+		}
+	}
+	return false;
+}
+
+void TaskPool::Core::Run(size_t index)
+{
+	SetThreadAffinity(affinity);
+	SetThreadName("task");
+
+	tlsPool = this;
+	tlsIndex = index;
+
+	Job job;
+	for (;;)
+	{
+		if (Pop(job))
+		{
+			try
+			{
+				job();
+			}
+			catch (...)
+			{
+			}
+			job = nullptr;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		if (!running.load() && pending.load() == 0) break;
+
+		sleeping.fetch_add(1);
+		wake.wait(lock, [this]() { return pending.load() != 0 || !running.load(); });
+		sleeping.fetch_sub(1);
+	}
+
+	tlsPool = nullptr;
+}
+
+TaskPool::TaskPool()
+	: mCore(new Core())
+{
+}
+
+TaskPool::~TaskPool()
+{
+	Stop();
+}
+
+void TaskPool::SetAffinity(const CPUSet& cpus)
+{
+	if (mCore->running.load()) return;
+	mCore->affinity = cpus;
+}
+
+void TaskPool::Start(uint threadNum)
+{
+	if (mCore->running.load()) return;
+
+	if (threadNum == 0)
+		threadNum = std::max(1u, std::thread::hardware_concurrency());
+
+	mCore->queues.clear();
+	for (uint i = 0; i < threadNum; ++i)
+		mCore->queues.emplace_back(new Core::Queue());
+
+	mCore->running = true;
+	mCore->threads.resize(threadNum);
+	for (uint i = 0; i < threadNum; ++i)
+	{
+		Core* core = mCore.get();
+		mCore->threads[i] = std::thread([core, i]() { core->Run(i); });
+	}
+}
+
+void TaskPool::Stop()
+{
+	if (!mCore->running.load()) return;
+
+	{
+		std::lock_guard<std::mutex> guard(mCore->sleepMutex);
+		mCore->running = false;
+		mCore->wake.notify_all();
+	}
+	for (size_t i = 0; i < mCore->threads.size(); ++i)
+	{
+		if (mCore->threads[i].joinable())
+			mCore->threads[i].join();
+	}
+	mCore->threads.clear();
+
+	// a Post() that saw running before it was cleared may push after the threads left
+	while (mCore->posting.load() != 0)
+		std::this_thread::yield();
+
+	Job job;
+	while (mCore->Pop(job))
+	{
+		try
+		{
+			job();
+		}
+		catch (...)
+		{
+		}
+		job = nullptr;
+	}
+}
+
+uint TaskPool::GetThreadNum()
+{
+	return (uint)mCore->threads.size();
+}
+
+void TaskPool::Post(const Job& job)
+{
+	if (job == nullptr) return;
+
+	// pairs with Stop(): either it sees posting or this sees running cleared
+	mCore->posting.fetch_add(1);
+	if (!mCore->running.load())
+	{
+		mCore->posting.fetch_sub(1);
+		job();
+		return;
+	}
+	mCore->Push(job);
+	mCore->posting.fetch_sub(1);
+}
+
+bool TaskPool::RunOne()
+{
+	if (!mCore->running.load()) return false;
+
+	Job job;
+	if (!mCore->Pop(job)) return false;
+	try
+	{
+		job();
+	}
+	catch (...)
+	{
+	}
+	return true;
+}
+
+void TaskPool::ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body)
+{
+	if (begin >= end || body == nullptr) return;
+	if (grain == 0) grain = 1;
+
+	const std::function<void(size_t, size_t)>* fn = &body;
+	TaskGroup group(*this);
+	size_t first = begin;
+	while (end - first > grain)
+	{
+		size_t last = first + grain;
+		group.Run([fn, first, last]() { (*fn)(first, last); });
+		first = last;
+	}
+
+	// the last chunk on this thread
+	body(first, end);
+	group.Wait();
+}
+
+TaskGroup::TaskGroup(TaskPool& pool)
+	: mPool(pool)
+	, mPending(new std::atomic<size_t>(0))
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+	Wait();
+}
+
+void TaskGroup::Run(const TaskPool::Job& job)
+{
+	if (job == nullptr) return;
+
+	std::shared_ptr<std::atomic<size_t> > pending = mPending;
+	pending->fetch_add(1);
+	mPool.Post([pending, job]()
+	{
+		try
+		{
+			job();
+		}
+		catch (...)
+		{
+		}
+		pending->fetch_sub(1);
+	});
+}
+
+void TaskGroup::Wait()
+{
+	while (mPending->load() != 0)
+	{
+		if (!mPool.RunOne())
+			std::this_thread::yield();
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef __UTILS_TASK_POOL_HEADER__
+#define __UTILS_TASK_POOL_HEADER__
+
+#include <utils/typedef.h>
+#include <utils/serial.h>
+#include <utils/system.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <type_traits>
+
+namespace utils
+{
+	// work-stealing pool for cpu bound jobs.
+	// each thread owns a deque: it takes its newest job first, idle threads steal the oldest from others.
+	// jobs posted from outside the pool are spread over the deques.
+	class TaskPool
+	{
+	public:
+		typedef std::function<void(void)> Job;
+
+		TaskPool();
+
+		~TaskPool();
+
+		// before Start(): cpus for the pool threads, named "task"
+		void SetAffinity(const CPUSet& cpus);
+
+		// threadNum 0: one per hardware thread
+		void Start(uint threadNum);
+
+		// queued jobs still run before Stop() returns, posts racing with it included
+		void Stop();
+
+		uint GetThreadNum();
+
+		// not started: the job runs on the calling thread
+		void Post(const Job& job);
+
+		// runs one queued job on the calling thread, returns false when none was found
+		bool RunOne();
+
+		// work() on the pool, then done(result) on the serial. void work: done()
+		template<typename Work, typename Done>
+		void Post(Serial& serial, Work work, Done done)
+		{
+			typedef typename std::decay<decltype(work())>::type Result;
+			PostWork(serial, work, done, std::is_void<Result>());
+		}
+
+		// body(first, last) over [begin, end) in chunks of `grain`, returns when all chunks are done.
+		// the calling thread runs chunks too
+		void ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+	private:
+		TaskPool(const TaskPool&) = delete;
+		TaskPool& operator=(const TaskPool&) = delete;
+
+		template<typename Work, typename Done>
+		void PostWork(Serial& serial, Work work, Done done, std::false_type)
+		{
+			typedef typename std::decay<decltype(work())>::type Result;
+			Serial* target = &serial;
+			Post([target, work, done]()
+			{
+				std::shared_ptr<Result> result(new Result(work()));
+				target->Post([done, result]() { done(*result); });
+			});
+		}
+
+		template<typename Work, typename Done>
+		void PostWork(Serial& serial, Work work, Done done, std::true_type)
+		{
+			Serial* target = &serial;
+			Post([target, work, done]()
+			{
+				work();
+				target->Post([done]() { done(); });
+			});
+		}
+
+	private:
+		struct Core;
+		std::shared_ptr<Core> mCore;
+	};
+
+	// fork/join on a TaskPool:
+	//   TaskGroup group(pool);
+	//   group.Run(a); group.Run(b);
+	//   group.Wait();
+	class TaskGroup
+	{
+	public:
+		explicit TaskGroup(TaskPool& pool);
+
+		// waits for the jobs still running
+		~TaskGroup();
+
+		void Run(const TaskPool::Job& job);
+
+		// helps the pool until every job of the group is done
+		void Wait();
+
+	private:
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+	private:
+		TaskPool& mPool;
+		std::shared_ptr<std::atomic<size_t> > mPending;
+	};
+}
+
+#endif
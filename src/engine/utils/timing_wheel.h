@@ -0,0 +1,343 @@
+#ifndef __UTILS_TIMING_WHEEL_HEADER__
+#define __UTILS_TIMING_WHEEL_HEADER__
+
+#include <utils/typedef.h>
+#include <deque>
+#include <utility>
+#include <vector>
+
+namespace utils
+{
+	// hierarchical timing wheel, time is counted in ticks.
+	// 256 slots of one tick, then four levels of 64 slots, each level 64 times coarser.
+	// add and cancel are O(1), nodes are kept in a pool and reused. not thread safe.
+	//
+	// usage:
+	//   while (auto* node = wheel.Expire(now)) { node->handler(node->id); wheel.Finish(node); }
+	template<typename Handler>
+	class TimingWheel
+	{
+	public:
+		struct Node
+		{
+			Node*   next;
+			Node**  pprev;
+			uint64  expire;   // tick
+			uint64  interval; // ticks, 0: fire once
+			uint    id;
+			uint    generation;
+			int     state;
+			int     wheel;    // linked in: 0 root, l + 1 level l. -1 pending or not linked
+			Handler handler;
+		};
+
+		TimingWheel()
+			: mNow(0)
+			, mCount(0)
+			, mPending(nullptr)
+		{
+			for (int i = 0; i < ROOT_SIZE; ++i)
+				mRoot[i] = nullptr;
+			for (int l = 0; l < LEVELS; ++l)
+				for (int i = 0; i < LEVEL_SIZE; ++i)
+					mLevels[l][i] = nullptr;
+			for (int w = 0; w <= LEVELS; ++w)
+				mLinked[w] = 0;
+		}
+
+		// the next tick to be processed
+		uint64 Now() const { return mNow; }
+
+		// active timers, including the one running
+		size_t Size() const { return mCount; }
+
+		bool Empty() const { return mCount == 0; }
+
+		// the first tick from Now() that Expire() has a node or a cascade for, ~0 when nothing is linked.
+		// a node far away is reported at the next cascade of its level, not at its own tick
+		uint64 NextTick() const
+		{
+			if (mPending != nullptr || mRoot[mNow & ROOT_MASK] != nullptr)
+				return mNow;
+
+			if ((mNow & ROOT_MASK) == 0)
+			{
+				for (int l = 0; l < LEVELS; ++l)
+				{
+					if (mLinked[l + 1] != 0) return mNow;
+				}
+			}
+			return NextBusy();
+		}
+
+		// fires at tick `expire` (or the next Expire() if already passed), then every `interval` ticks.
+		// returns timer id, 0 when the pool is exhausted
+		uint Add(uint64 expire, uint64 interval, Handler&& handler)
+		{
+			Node* node = AllocNode();
+			if (node == nullptr) return 0;
+
+			node->expire = expire;
+			node->interval = interval;
+			node->handler = std::move(handler);
+			node->state = STATE_LINKED;
+			Place(node);
+			++mCount;
+			return node->id;
+		}
+
+		bool Cancel(uint id)
+		{
+			Node* node = FindNode(id);
+			if (node == nullptr) return false;
+
+			if (node->state == STATE_RUNNING)
+			{
+				// freed by Finish()
+				node->state = STATE_CANCELLED;
+				--mCount;
+				return true;
+			}
+
+			if (node->state != STATE_LINKED) return false;
+
+			if (node->wheel >= 0)
+				--mLinked[node->wheel];
+			Unlink(node);
+			FreeNode(node);
+			--mCount;
+			return true;
+		}
+
+		// advances the wheel up to tick `now` and returns one due node, nullptr when none is due.
+		// the node stays valid until Finish(), it may be cancelled meanwhile.
+		Node* Expire(uint64 now)
+		{
+			for (;;)
+			{
+				if (mPending != nullptr)
+				{
+					Node* node = mPending;
+					Unlink(node);
+					node->state = STATE_RUNNING;
+					return node;
+				}
+
+				if (mNow > now) return nullptr;
+
+				int index = int(mNow & ROOT_MASK);
+				if (index != 0 && mRoot[index] == nullptr)
+				{
+					// nothing before the next busy tick, e.g. after a long idle time
+					uint64 next = NextBusy();
+					mNow = next <= now ? next : now + 1;
+					continue;
+				}
+
+				if (index == 0)
+				{
+					for (int l = 0; l < LEVELS; ++l)
+					{
+						if (Cascade(l) != 0) break;
+					}
+				}
+
+				Node* list = mRoot[index];
+				mRoot[index] = nullptr;
+				if (list != nullptr)
+				{
+					list->pprev = &mPending;
+					mPending = list;
+					for (Node* node = list; node != nullptr; node = node->next)
+					{
+						node->wheel = -1;
+						--mLinked[0];
+					}
+				}
+				++mNow;
+			}
+		}
+
+		// reschedules a periodic node or releases it
+		void Finish(Node* node)
+		{
+			if (node->state == STATE_CANCELLED || node->interval == 0)
+			{
+				if (node->state != STATE_CANCELLED)
+					--mCount;
+				FreeNode(node);
+				return;
+			}
+
+			node->expire += node->interval;
+			node->state = STATE_LINKED;
+			Place(node);
+		}
+
+	private:
+		enum
+		{
+			ROOT_BITS  = 8,
+			ROOT_SIZE  = 1 << ROOT_BITS,
+			ROOT_MASK  = ROOT_SIZE - 1,
+			LEVEL_BITS = 6,
+			LEVEL_SIZE = 1 << LEVEL_BITS,
+			LEVEL_MASK = LEVEL_SIZE - 1,
+			LEVELS     = 4,
+
+			INDEX_BITS = 22,
+			INDEX_MASK = (1 << INDEX_BITS) - 1,
+		};
+
+		enum
+		{
+			STATE_FREE,
+			STATE_LINKED,
+			STATE_RUNNING,
+			STATE_CANCELLED,
+		};
+
+		static void Link(Node** head, Node* node)
+		{
+			node->next = *head;
+			node->pprev = head;
+			if (*head != nullptr)
+				(*head)->pprev = &node->next;
+			*head = node;
+		}
+
+		static void Unlink(Node* node)
+		{
+			*node->pprev = node->next;
+			if (node->next != nullptr)
+				node->next->pprev = node->pprev;
+			node->next = nullptr;
+			node->pprev = nullptr;
+		}
+
+		void Place(Node* node)
+		{
+			uint64 expire = node->expire;
+			if (expire < mNow)
+				expire = mNow;
+
+			uint64 delta = expire - mNow;
+			if (delta < ROOT_SIZE)
+			{
+				Link(&mRoot[expire & ROOT_MASK], node);
+				node->wheel = 0;
+				++mLinked[0];
+				return;
+			}
+
+			for (int l = 0; l < LEVELS; ++l)
+			{
+				int shift = ROOT_BITS + l * LEVEL_BITS;
+				if (l == LEVELS - 1 || delta < (uint64(1) << (shift + LEVEL_BITS)))
+				{
+					// beyond the top level the node is cascaded again until it gets close
+					Link(&mLevels[l][(expire >> shift) & LEVEL_MASK], node);
+					node->wheel = l + 1;
+					++mLinked[l + 1];
+					return;
+				}
+			}
+		}
+
+		// moves level `l` slot of the current time one level down, returns the slot index
+		int Cascade(int l)
+		{
+			int index = int((mNow >> (ROOT_BITS + l * LEVEL_BITS)) & LEVEL_MASK);
+			Node* list = mLevels[l][index];
+			mLevels[l][index] = nullptr;
+			while (list != nullptr)
+			{
+				Node* node = list;
+				list = list->next;
+				node->next = nullptr;
+				node->pprev = nullptr;
+				--mLinked[l + 1];
+				Place(node);
+			}
+			return index;
+		}
+
+		// the first tick after mNow with a root slot to run or a cascade that can move nodes.
+		// cascades of empty levels are skipped, an empty wheel has none
+		uint64 NextBusy() const
+		{
+			if (mLinked[0] != 0)
+			{
+				uint64 tick = mNow + 1;
+				while ((tick & ROOT_MASK) != 0 && mRoot[tick & ROOT_MASK] == nullptr)
+					++tick;
+				return tick;
+			}
+
+			for (int l = 0; l < LEVELS; ++l)
+			{
+				if (mLinked[l + 1] != 0)
+				{
+					uint64 period = uint64(1) << (ROOT_BITS + l * LEVEL_BITS);
+					return (mNow | (period - 1)) + 1;
+				}
+			}
+			return ~uint64(0);
+		}
+
+		Node* AllocNode()
+		{
+			Node* node;
+			if (!mFree.empty())
+			{
+				node = mFree.back();
+				mFree.pop_back();
+			}
+			else
+			{
+				if (mNodes.size() >= INDEX_MASK) return nullptr;
+				mNodes.emplace_back();
+				node = &mNodes.back();
+				node->generation = 0;
+				node->id = uint(mNodes.size()); // index + 1
+			}
+			node->next = nullptr;
+			node->pprev = nullptr;
+			node->wheel = -1;
+			node->id = (node->id & INDEX_MASK) | (node->generation << INDEX_BITS);
+			return node;
+		}
+
+		void FreeNode(Node* node)
+		{
+			node->state = STATE_FREE;
+			node->handler = nullptr;
+			node->generation = (node->generation + 1) & (0xffffffffu >> INDEX_BITS);
+			mFree.push_back(node);
+		}
+
+		Node* FindNode(uint id)
+		{
+			size_t index = id & INDEX_MASK;
+			if (index == 0 || index > mNodes.size()) return nullptr;
+
+			Node* node = &mNodes[index - 1];
+			if (node->id != id || node->state == STATE_FREE) return nullptr;
+			return node;
+		}
+
+	private:
+		uint64 mNow;
+		size_t mCount;
+
+		Node* mRoot[ROOT_SIZE];
+		Node* mLevels[LEVELS][LEVEL_SIZE];
+		Node* mPending;
+		size_t mLinked[LEVELS + 1]; // nodes in the root and each level
+
+		std::deque<Node>   mNodes; // stable addresses
+		std::vector<Node*> mFree;
+	};
+}
+
+#endif